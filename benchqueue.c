@@ -0,0 +1,477 @@
+/*
+    Throughput benchmark for the queue modes.
+
+    Each mode moves the same number of items from producer to consumer threads, and is
+    reported in items per second and relative to the plain in-memory queue. Each item is
+    numbered as it is enqueued, so the order of dequeues also gives the rank error: how
+    many older items were still queued when an item was taken, 0 for strict FIFO (up to
+    the jitter between numbering an item and enqueuing it). Separately, each mode holds
+    all the items at once to measure the heap it uses per queued item.
+
+    First of all, while the heap is still cold, a single thread enqueues every item into
+    a fresh queue with and without a node arena sized to the items: the arena moves the
+    cost of faulting in memory from the first burst to initialization, which is reported
+    together with the burst's duration and its slowest enqueue.
+
+    Then the relaxed queue moves a tenth as many items one at a time, each dequeued
+    before the next is enqueued, with more and more sub-queues: nearly all of them are
+    empty, so this is the cost of finding the one item among them.
+
+    Last, a producer sends a tenth as many refresh notifications for a handful of keys to
+    a consumer that does a little work per notification, with and without coalescing:
+    the rate is notifications delivered per second until the consumer has caught up.
+
+        ./benchqueue [items] [producers] [consumers]
+*/
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <malloc.h>
+#include "queue.h"
+#include "relaxed_queue.h"
+
+struct BenchMode
+{
+    const char *name;
+    bool (*init)(void);
+    void (*destroy)(void);
+    void (*enqueue)(void *);
+    void *(*dequeue)(void);
+    void (*cleanup)(void);
+};
+
+struct RankError
+{
+    double mean;
+    size_t max;
+};
+
+struct Worker
+{
+    size_t quota;
+};
+
+static size_t num_items = 1000000;
+static size_t num_producers = 1;
+static size_t num_consumers = 1;
+static char spill_directory[] = "/tmp/benchqueue-XXXXXX";
+static const struct BenchMode *mode;
+static atomic_size_t next_number;
+static atomic_size_t dequeue_count;
+// The numbers of the items in the order they were dequeued.
+static size_t *dequeue_order;
+
+#define REFRESH_KEYS 64
+#define REFRESH_WORK 10000
+static atomic_bool producing_refreshes;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t serialize_item(void *element, void *buffer, size_t capacity)
+{
+    if (capacity >= sizeof(uintptr_t))
+    {
+        memcpy(buffer, &element, sizeof(uintptr_t));
+    }
+    return sizeof(uintptr_t);
+}
+
+static void *deserialize_item(const void *buffer, size_t length)
+{
+    (void)length;
+    void *element;
+    memcpy(&element, buffer, sizeof(uintptr_t));
+    return element;
+}
+
+static bool init_memory(void)
+{
+    initQueue();
+    return true;
+}
+
+static bool init_spill(bool durable)
+{
+    struct QueueOptions options = {0};
+    options.spill_directory = spill_directory;
+    options.spill_threshold = 0;
+    options.spill_durable = durable;
+    options.serialize = serialize_item;
+    options.deserialize = deserialize_item;
+    return initQueueWithOptions(&options);
+}
+
+static bool init_spill_buffered(void)
+{
+    return init_spill(false);
+}
+
+static bool init_spill_durable(void)
+{
+    return init_spill(true);
+}
+
+static bool init_compact(void)
+{
+    struct QueueOptions options = {0};
+    options.compact = true;
+    return initQueueWithOptions(&options);
+}
+
+static bool init_arena(bool compact)
+{
+    struct QueueOptions options = {0};
+    options.compact = compact;
+    options.expected_depth = num_items;
+    return initQueueWithOptions(&options);
+}
+
+static bool init_memory_arena(void)
+{
+    return init_arena(false);
+}
+
+static bool init_compact_arena(void)
+{
+    return init_arena(true);
+}
+
+static bool init_relaxed(void)
+{
+    return initRelaxedQueue(0);
+}
+
+static void cleanup_spill(void)
+{
+    DIR *directory = opendir(spill_directory);
+    struct dirent *entry;
+    char path[sizeof(spill_directory) + 256];
+    while (directory != NULL && (entry = readdir(directory)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+        {
+            snprintf(path, sizeof(path), "%s/%s", spill_directory, entry->d_name);
+            unlink(path);
+        }
+    }
+    if (directory != NULL)
+    {
+        closedir(directory);
+    }
+}
+
+static const struct BenchMode modes[] = {
+    {"memory", init_memory, destroyQueue, enqueue, dequeue, NULL},
+    {"compact", init_compact, destroyQueue, enqueue, dequeue, NULL},
+    {"spill", init_spill_buffered, destroyQueue, enqueue, dequeue, cleanup_spill},
+    {"spill-durable", init_spill_durable, destroyQueue, enqueue, dequeue, cleanup_spill},
+    {"relaxed", init_relaxed, destroyRelaxedQueue, relaxedEnqueue, relaxedDequeue, NULL},
+};
+
+static const struct BenchMode cold_modes[] = {
+    {"memory", init_memory, destroyQueue, enqueue, dequeue, NULL},
+    {"memory+arena", init_memory_arena, destroyQueue, enqueue, dequeue, NULL},
+    {"compact", init_compact, destroyQueue, enqueue, dequeue, NULL},
+    {"compact+arena", init_compact_arena, destroyQueue, enqueue, dequeue, NULL},
+};
+
+static bool init_coalescing(void)
+{
+    struct QueueOptions options = {0};
+    options.coalesce = true;
+    return initQueueWithOptions(&options);
+}
+
+static const size_t low_occupancy_subqueues[] = {1, 4, 64, 256, 1024};
+
+static const struct BenchMode refresh_modes[] = {
+    {"memory", init_memory, destroyQueue, enqueue, dequeue, NULL},
+    {"coalescing", init_coalescing, destroyQueue, enqueue, dequeue, NULL},
+};
+
+int produce(void *arg)
+{
+    struct Worker *worker = (struct Worker *)arg;
+    for (size_t i = 0; i < worker->quota; i++)
+    {
+        // Numbered from 1, since items must not be NULL
+        mode->enqueue((void *)(uintptr_t)(atomic_fetch_add(&next_number, 1) + 1));
+    }
+    return 0;
+}
+
+int consume(void *arg)
+{
+    struct Worker *worker = (struct Worker *)arg;
+    for (size_t i = 0; i < worker->quota; i++)
+    {
+        size_t number = (uintptr_t)mode->dequeue() - 1;
+        dequeue_order[atomic_fetch_add(&dequeue_count, 1)] = number;
+    }
+    return 0;
+}
+
+int produce_refreshes(void *arg)
+{
+    size_t count = *(size_t *)arg;
+    for (size_t i = 0; i < count; i++)
+    {
+        enqueueKeyed(i % REFRESH_KEYS, (void *)(uintptr_t)(i % REFRESH_KEYS + 1));
+    }
+    atomic_store(&producing_refreshes, false);
+    return 0;
+}
+
+int consume_refreshes(void *arg)
+{
+    size_t *processed = (size_t *)arg;
+    while (true)
+    {
+        // Checked before trying, so that a failed try after the last enqueue really means done.
+        bool done = !atomic_load(&producing_refreshes);
+        void *item;
+        if (tryDequeue(&item))
+        {
+            for (volatile size_t work = 0; work < REFRESH_WORK; work++)
+            {
+            }
+            (*processed)++;
+        }
+        else if (done)
+        {
+            return 0;
+        }
+        else
+        {
+            thrd_yield();
+        }
+    }
+}
+
+/*
+    An item's rank error is the number of items numbered before it that had not been
+    dequeued yet, counted with a Fenwick tree over the numbers dequeued so far.
+*/
+static struct RankError rank_error(void)
+{
+    size_t *dequeued = calloc(num_items + 1, sizeof(size_t));
+    struct RankError error = {0, 0};
+    for (size_t i = 0; i < num_items; i++)
+    {
+        size_t number = dequeue_order[i];
+        size_t older_dequeued = 0;
+        for (size_t j = number; j > 0; j -= j & -j)
+        {
+            older_dequeued += dequeued[j];
+        }
+        for (size_t j = number + 1; j <= num_items; j += j & -j)
+        {
+            dequeued[j]++;
+        }
+        size_t rank = number - older_dequeued;
+        error.mean += rank;
+        error.max = rank > error.max ? rank : error.max;
+    }
+    error.mean /= num_items;
+    free(dequeued);
+    return error;
+}
+
+static size_t heap_in_use(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// Queues every item at once, without consumers, and returns the heap growth per item.
+static double heap_per_item(const struct BenchMode *run)
+{
+    if (!run->init())
+    {
+        return 0;
+    }
+    size_t before = heap_in_use();
+    for (size_t i = 1; i <= num_items; i++)
+    {
+        run->enqueue((void *)(uintptr_t)i);
+    }
+    double per_item = (double)(heap_in_use() - before) / num_items;
+    run->destroy();
+    if (run->cleanup != NULL)
+    {
+        run->cleanup();
+    }
+    return per_item;
+}
+
+static void run_cold_start(const struct BenchMode *run)
+{
+    double start = now_seconds();
+    if (!run->init())
+    {
+        printf("%-16s %14s\n", run->name, "unavailable");
+        return;
+    }
+    double initialized = now_seconds();
+    double slowest = 0;
+    for (size_t i = 1; i <= num_items; i++)
+    {
+        double before = now_seconds();
+        run->enqueue((void *)(uintptr_t)i);
+        double took = now_seconds() - before;
+        slowest = took > slowest ? took : slowest;
+    }
+    double burst = now_seconds() - initialized;
+    run->destroy();
+    printf("%-16s %14.2f %14.2f %14.1f\n", run->name, (initialized - start) * 1e3, burst * 1e3, slowest * 1e6);
+}
+
+static void run_low_occupancy(size_t subqueues)
+{
+    if (!initRelaxedQueue(subqueues))
+    {
+        return;
+    }
+    size_t count = num_items / 10;
+    double start = now_seconds();
+    for (size_t i = 1; i <= count; i++)
+    {
+        relaxedEnqueue((void *)(uintptr_t)i);
+        relaxedDequeue();
+    }
+    double elapsed = now_seconds() - start;
+    destroyRelaxedQueue();
+    printf("%-16zu %14.1f\n", subqueues, elapsed * 1e9 / count);
+}
+
+static void run_refreshes(const struct BenchMode *run)
+{
+    if (!run->init())
+    {
+        printf("%-16s %14s\n", run->name, "unavailable");
+        return;
+    }
+    size_t count = num_items / 10;
+    size_t processed = 0;
+    atomic_store(&producing_refreshes, true);
+    thrd_t producer, consumer;
+    double start = now_seconds();
+    thrd_create(&consumer, consume_refreshes, &processed);
+    thrd_create(&producer, produce_refreshes, &count);
+    thrd_join(producer, NULL);
+    thrd_join(consumer, NULL);
+    double elapsed = now_seconds() - start;
+    run->destroy();
+    printf("%-16s %14.0f %14zu %14.2f\n", run->name, count / elapsed, processed, elapsed * 1e3);
+}
+
+// Returns the throughput in items per second, or 0 if the mode could not be set up.
+static double run_mode(const struct BenchMode *run, struct RankError *error)
+{
+    mode = run;
+    if (!mode->init())
+    {
+        return 0;
+    }
+    atomic_store(&next_number, 0);
+    atomic_store(&dequeue_count, 0);
+    size_t num_threads = num_producers + num_consumers;
+    struct Worker *workers = malloc(num_threads * sizeof(struct Worker));
+    thrd_t *threads = malloc(num_threads * sizeof(thrd_t));
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        bool is_producer = t < num_producers;
+        size_t index = is_producer ? t : t - num_producers;
+        size_t share = is_producer ? num_producers : num_consumers;
+        workers[t].quota = num_items / share + (index < num_items % share);
+    }
+
+    double start = now_seconds();
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        thrd_create(&threads[t], t < num_producers ? produce : consume, &workers[t]);
+    }
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        thrd_join(threads[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    *error = rank_error();
+    mode->destroy();
+    if (mode->cleanup != NULL)
+    {
+        mode->cleanup();
+    }
+    free(threads);
+    free(workers);
+    return num_items / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    num_items = argc > 1 ? strtoull(argv[1], NULL, 0) : num_items;
+    num_producers = argc > 2 ? strtoull(argv[2], NULL, 0) : num_producers;
+    num_consumers = argc > 3 ? strtoull(argv[3], NULL, 0) : num_consumers;
+    if (mkdtemp(spill_directory) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    printf("%zu items, %zu producers, %zu consumers\n", num_items, num_producers, num_consumers);
+    printf("%-16s %14s %14s %14s\n", "cold start", "init ms", "burst ms", "max enq us");
+    for (size_t m = 0; m < sizeof(cold_modes) / sizeof(cold_modes[0]); m++)
+    {
+        run_cold_start(&cold_modes[m]);
+    }
+
+    dequeue_order = malloc(num_items * sizeof(size_t));
+    printf("%-16s %14s %10s %12s %10s %12s\n", "mode", "items/s", "slowdown", "mean rank", "max rank", "heap B/item");
+    double baseline = 0;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        struct RankError error = {0, 0};
+        double throughput = run_mode(&modes[m], &error);
+        if (baseline == 0)
+        {
+            baseline = throughput;
+        }
+        if (throughput == 0)
+        {
+            printf("%-16s %14s\n", modes[m].name, "unavailable");
+            continue;
+        }
+        printf("%-16s %14.0f %9.2fx %12.2f %10zu %12.1f\n", modes[m].name, throughput, baseline / throughput, error.mean,
+               error.max, heap_per_item(&modes[m]));
+    }
+
+    free(dequeue_order);
+
+    printf("%-16s %14s\n", "sub-queues", "ns/item");
+    for (size_t s = 0; s < sizeof(low_occupancy_subqueues) / sizeof(low_occupancy_subqueues[0]); s++)
+    {
+        run_low_occupancy(low_occupancy_subqueues[s]);
+    }
+
+    printf("%-16s %14s %14s %14s\n", "refreshes", "sent/s", "processed", "ms");
+    for (size_t m = 0; m < sizeof(refresh_modes) / sizeof(refresh_modes[0]); m++)
+    {
+        run_refreshes(&refresh_modes[m]);
+    }
+    rmdir(spill_directory);
+    return 0;
+}
@@ -0,0 +1,166 @@
+#define _DEFAULT_SOURCE
+#include "node_arena.h"
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+struct FreeSlot
+{
+    struct FreeSlot *next;
+};
+
+struct NodeArena
+{
+    char *base;
+    size_t mapped_size;
+    size_t slot_size;
+    size_t capacity;
+    // Slots below this index have been handed out at least once.
+    size_t used;
+    /*
+        Freed slots, pushed from any thread but only popped by the serialized arena_alloc.
+        With a single popper a slot cannot leave and return to the stack during a pop, so
+        the compare-and-swap cannot be fooled by a recycled head.
+    */
+    _Atomic(struct FreeSlot *) free_slots;
+    bool huge_pages;
+};
+
+static char *map_huge_pages(size_t size);
+static char *map_transparent_huge_pages(size_t size, bool *huge_pages);
+static void populate(char *base, size_t size);
+
+struct NodeArena *arena_create(size_t slot_size, size_t capacity)
+{
+    // Slots hold nodes with pointers and 64-bit fields, so they keep malloc's alignment.
+    size_t alignment = _Alignof(max_align_t);
+    slot_size = (slot_size + alignment - 1) / alignment * alignment;
+    size_t size = (slot_size * capacity + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    bool huge_pages = true;
+    char *base = map_huge_pages(size);
+    if (base == NULL)
+    {
+        base = map_transparent_huge_pages(size, &huge_pages);
+    }
+    if (base == NULL)
+    {
+        return NULL;
+    }
+    struct NodeArena *arena = (struct NodeArena *)malloc(sizeof(struct NodeArena));
+    if (arena == NULL)
+    {
+        munmap(base, size);
+        return NULL;
+    }
+    arena->base = base;
+    arena->mapped_size = size;
+    arena->slot_size = slot_size;
+    arena->capacity = capacity;
+    arena->used = 0;
+    atomic_init(&arena->free_slots, NULL);
+    arena->huge_pages = huge_pages;
+    return arena;
+}
+
+void arena_destroy(struct NodeArena *arena)
+{
+    munmap(arena->base, arena->mapped_size);
+    free(arena);
+}
+
+void *arena_alloc(struct NodeArena *arena)
+{
+    struct FreeSlot *slot = atomic_load(&arena->free_slots);
+    while (slot != NULL && !atomic_compare_exchange_weak(&arena->free_slots, &slot, slot->next))
+    {
+    }
+    if (slot != NULL)
+    {
+        return slot;
+    }
+    if (arena->used == arena->capacity)
+    {
+        return NULL;
+    }
+    return arena->base + arena->slot_size * arena->used++;
+}
+
+void arena_free(struct NodeArena *arena, void *slot)
+{
+    struct FreeSlot *freed = (struct FreeSlot *)slot;
+    freed->next = atomic_load(&arena->free_slots);
+    while (!atomic_compare_exchange_weak(&arena->free_slots, &freed->next, freed))
+    {
+    }
+}
+
+bool arena_owns(struct NodeArena *arena, const void *slot)
+{
+    const char *address = (const char *)slot;
+    return address >= arena->base && address < arena->base + arena->slot_size * arena->capacity;
+}
+
+bool arena_huge_pages(struct NodeArena *arena)
+{
+    return arena->huge_pages;
+}
+
+// Explicit huge pages come from the pool reserved in /proc/sys/vm/nr_hugepages, and fail if it is too small.
+static char *map_huge_pages(size_t size)
+{
+#ifdef MAP_HUGETLB
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    return base == MAP_FAILED ? NULL : (char *)base;
+#else
+    (void)size;
+    return NULL;
+#endif
+}
+
+/*
+    Transparent huge pages need a region aligned to the huge page size, and must be asked
+    for before the pages are faulted in, so this maps with slack to align the region and
+    populates it only after madvise.
+*/
+static char *map_transparent_huge_pages(size_t size, bool *huge_pages)
+{
+    size_t mapped_size = size + HUGE_PAGE_SIZE;
+    char *mapped = (char *)mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+    {
+        return NULL;
+    }
+    char *base = (char *)(((uintptr_t)mapped + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (base > mapped)
+    {
+        munmap(mapped, base - mapped);
+    }
+    munmap(base + size, mapped + mapped_size - (base + size));
+#ifdef MADV_HUGEPAGE
+    *huge_pages = madvise(base, size, MADV_HUGEPAGE) == 0;
+#else
+    *huge_pages = false;
+#endif
+    populate(base, size);
+    return base;
+}
+
+static void populate(char *base, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(base, size, MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+#endif
+    // Older kernels: write to every page, which MAP_POPULATE would have done before madvise.
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += page_size)
+    {
+        ((volatile char *)base)[offset] = 0;
+    }
+}
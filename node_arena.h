@@ -0,0 +1,35 @@
+#ifndef NODE_ARENA_H
+#define NODE_ARENA_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+    A fixed pool of equally sized slots in one mmap'ed region, faulted in up front and
+    backed by huge pages where the system allows, so that taking a slot never faults or
+    calls the allocator. arena_alloc must be serialized by the caller; the queue calls
+    it under its lock. arena_free may be called from any thread, since the queue frees
+    nodes after unlocking.
+*/
+struct NodeArena;
+
+// Returns NULL if the region cannot be mapped or the arena allocated.
+struct NodeArena *arena_create(size_t slot_size, size_t capacity);
+void arena_destroy(struct NodeArena *arena);
+// Returns NULL once every slot is in use.
+void *arena_alloc(struct NodeArena *arena);
+void arena_free(struct NodeArena *arena, void *slot);
+bool arena_owns(struct NodeArena *arena, const void *slot);
+// Whether the region got explicit huge pages, or transparent ones were successfully requested for it.
+bool arena_huge_pages(struct NodeArena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,7 +1,19 @@
 #include "queue.h"
+#include "spill_log.h"
+#include "queue_trace.h"
+#include "node_arena.h"
 #include <threads.h>
 #include <stdatomic.h>
 #include <stdlib.h>
+#include <limits.h>
+
+/*
+    Hook for the stress harness: it defines this before including queue.c to inject
+    seeded scheduling delays at the points where the locking is most delicate.
+*/
+#ifndef QUEUE_SCHEDULE_POINT
+#define QUEUE_SCHEDULE_POINT()
+#endif
 
 struct ThreadQueue
 {
@@ -10,298 +22,2159 @@ struct ThreadQueue
     atomic_ulong waiting_count;
 };
 
+/*
+    A sleeping dequeuer. It lives on the sleeping thread's stack, since it is only
+    reachable from the thread queue for as long as that thread is blocked. Asynchronous
+    waiters have no thread to block: theirs is allocated by dequeueAsync and freed once
+    they have been resumed.
+*/
 struct ThreadElement
 {
-    thrd_t id;
     struct ThreadElement *next;
+    // Sleepers that time out leave from the middle of their thread queue, so it is doubly linked.
+    struct ThreadElement *prev;
     // Each thread has its own condition variable so we can signal it independently.
     cnd_t cnd_thread;
     bool terminated;
-    int waiting_on;
+    // Set by cancelDequeue, which also takes the sleeper out of its thread queue.
+    bool cancelled;
+    // Set together with data by the enqueuer that hands this thread its item.
+    bool delivered;
+    void *data;
+    // Sleep order across thread queues, so a tagged item goes to the oldest eligible sleeper.
+    unsigned long ticket;
+    // Set for asynchronous waiters, which are resumed through this instead of cnd_thread.
+    queue_resume_fn resume;
+    void *context;
+#ifdef QUEUE_TRACE
+    uint64_t handed_off_at;
+#endif
+};
+
+/*
+    A set of consumers competing for the same items. Plain dequeue() callers form the
+    default group; every subscribed group reads the same log through its own cursor.
+*/
+struct ConsumerGroup
+{
+    // The next element this group will read, or NULL once it has caught up with the tail.
+    struct DataElement *cursor;
+    atomic_ulong queue_size;
+    atomic_ulong visited_count;
+    struct ThreadQueue thread_queue;
+    bool subscribed;
 };
 
-// We implement the queue as a linked list, saving its head and tail.
+/*
+    We implement the queue as a linked list, saving its head and tail. The head is the
+    oldest element some group has yet to read; with no subscribed groups it is simply
+    the default group's cursor.
+*/
 struct DataQueue
 {
     struct DataElement *head;
     struct DataElement *tail;
-    atomic_ulong queue_size;
-    atomic_ulong visited_count;
     atomic_ulong enqueued_count;
     mtx_t data_queue_lock;
+    // Signalled by the last terminated sleeper so destroyQueue can tear down the lock.
+    cnd_t drained;
+    size_t terminating_count;
+    // One past the highest subscribed group, so enqueue only scans the slots in use.
+    int group_limit;
+    unsigned long sleep_tickets;
+    struct QueueOptions options;
+    // The default group's items past the spill threshold, oldest first, when spilling is enabled.
+    struct SpillLog *spill_log;
+    // Broadcast whenever a group commit makes more spilled items durable.
+    cnd_t spill_synced;
+    // The default group's untagged items in compact mode, oldest first.
+    struct CompactSegment *compact_head;
+    struct CompactSegment *compact_tail;
+    // The last segment emptied, kept so that a queue hovering around a segment boundary does not churn malloc.
+    struct CompactSegment *compact_spare;
+    // Pre-faulted storage for list elements and compact segments, when an expected depth is given.
+    struct NodeArena *element_arena;
+    struct NodeArena *segment_arena;
+    // Fair mode's tenants, indexed by id, and the ring of those with items in turn order.
+    struct Tenant *tenants;
+    struct Tenant *active_head;
+    struct Tenant *active_tail;
+    // The default group's items in the tenants' sub-queues, which tenant 0's backlog excludes.
+    size_t tenant_items;
+    // Coalescing mode's open-addressed index from each key to its pending element.
+    struct DataElement **key_index;
+    size_t key_index_capacity;
+    size_t key_index_count;
 };
 
 struct DataElement
 {
     struct DataElement *next;
-    int index;
+    // Tagged consumers remove elements from the middle of the list, so it is doubly linked.
+    struct DataElement *prev;
+    // The enqueue order, which the default group uses to interleave elements with compact segments.
+    unsigned long index;
+    int tag;
+    /*
+        The groups that have yet to read this element, one bit per group. A group may not
+        have stored an element that others did, e.g. when the default group spilled it or
+        a sleeper of its took it, so each group's cursor skips elements without its bit.
+    */
+    unsigned readers;
+    // Iterators pin the element they stopped at, which keeps it in the list until they move on.
+    unsigned pins;
+    // Set while the element is in the coalescing index under its key.
+    bool keyed;
+    // Set if the element was allocated as a StampedElement.
+    bool stamped;
     void *data;
 };
 
 /*
-    We keep track of the threads in order of sleep time in order to
-    always signal the oldest one and thus maintain the FIFO order between them.
+    An element with the fields only some items need, allocated in place of a plain one
+    for tagged and keyed items, and for every item when ages are tracked or traced, so
+    plain enqueues neither store them nor read the clock.
+*/
+struct StampedElement
+{
+    struct DataElement element;
+    union
+    {
+        // The next element with the same tag that the default group has yet to read.
+        struct DataElement *next_same_tag;
+        // Keyed items are untagged, so their key takes the place of the tag chain.
+        uint64_t key;
+    };
+    // For the latency of a tagged element's stage, and the age peek() reports.
+    uint64_t enqueued_at;
+};
+
+/*
+    A run of consecutively enqueued items, stored in compact mode as a slice of slots
+    rather than as list elements. The enqueue order of an item is derived from its slot.
+*/
+struct CompactSegment
+{
+    struct CompactSegment *next;
+    // The enqueue order of slots[0].
+    unsigned long base_index;
+    // The occupied slots are [head, tail).
+    unsigned head;
+    unsigned tail;
+    // Iterators pin the segment they stopped in; emptied while pinned, it is left unlinked for them to free.
+    unsigned pins;
+    void *slots[QUEUE_COMPACT_SEGMENT_SLOTS];
+};
+
+/*
+    The default group's unread elements with a given tag, threaded through the list in
+    FIFO order, so the oldest matching element is always at the head. Its sleepers are
+    only handed items with that tag.
+*/
+struct TagQueue
+{
+    struct DataElement *head;
+    struct DataElement *tail;
+    atomic_ulong queue_size;
+    struct ThreadQueue thread_queue;
+    // Stage statistics, counting the items that left this tag's queue and the time they spent in it.
+    unsigned long completed_count;
+    uint64_t total_latency;
+    uint64_t max_latency;
+};
+
+/*
+    A tenant's items for the default group in fair mode, served by deficit round-robin.
+    Tenant 0 has no sub-queue of its own: its items are whatever the default group holds
+    in the list, the compact segments and the spill log.
+*/
+struct Tenant
+{
+    // Linked through next, oldest first.
+    struct DataElement *head;
+    struct DataElement *tail;
+    size_t queue_size;
+    unsigned weight;
+    // The items the tenant may still take in its current turn.
+    unsigned deficit;
+    unsigned long served_count;
+    struct Tenant *next_active;
+    bool active;
+};
+
+// Where an iterator resumes its walk of a tenant's sub-queue, at an element it pinned.
+struct TenantPosition
+{
+    struct Tenant *tenant;
+    struct DataElement *element;
+};
+
+/*
+    We keep track of the threads of each group in order of sleep time in order to
+    always serve the oldest one and thus maintain the FIFO order between them.
+    An item is only ever stored for a group when none of its consumers is sleeping:
+    otherwise enqueue hands it straight to the oldest sleeper, so a thread that arrives
+    later can never overtake one that is already waiting.
 */
-static struct ThreadQueue thread_queue;
+static struct ConsumerGroup groups[QUEUE_MAX_GROUPS + 1];
+static struct TagQueue tags[QUEUE_MAX_TAGS];
 static struct DataQueue data_queue;
-static thrd_t terminator;
-
-void free_all_data_elements(void);
-void destroy_thread_queue(void);
-struct DataElement *create_element(void *data);
-void add_element_to_data_queue(struct DataElement *new_element);
-void add_element_to_empty_data_queue(struct DataElement *new_element);
-void add_element_to_nonempty_data_queue(struct DataElement *new_element);
-bool current_thread_should_sleep(void);
-void thread_enqueue(void);
-void thread_dequeue(void);
-void add_element_to_thread_queue(struct ThreadElement *new_element);
-void add_element_to_empty_thread_queue(struct ThreadElement *new_element);
-void add_element_to_nonempty_thread_queue(struct ThreadElement *new_element);
-struct ThreadElement *create_thread_element(void);
-int get_current_first_waiting_on(void);
+#define default_group (&groups[0])
+#define group_bit(group) (1u << ((group) - groups))
+_Static_assert(QUEUE_MAX_GROUPS < 32, "a group bit per group must fit in DataElement.readers");
+
+static void free_all_data_elements(void);
+static void reset_group(struct ConsumerGroup *group);
+static void reset_tag(struct TagQueue *tag_queue);
+static void release_storage(void);
+static void enqueue_item(int tag, int tenant, void *element_data);
+static uint64_t publish(int tag, int tenant, const uint64_t *key, void *element_data, struct DataElement **spare, struct ThreadElement **resumed);
+static void finish_enqueue(uint64_t spilled_sequence, struct ThreadElement *resumed);
+static void complete_stage(struct TagQueue *tag_queue, uint64_t enqueued_at);
+static bool should_spill(struct ConsumerGroup *group, int tag);
+static bool should_compact(struct ConsumerGroup *group, int tag);
+static void add_to_compact_segment(void *data);
+static bool compact_is_older(struct ConsumerGroup *group);
+static void take_compact(struct ConsumerGroup *group, void **data);
+static void free_compact_segments(void);
+static void wait_until_durable(uint64_t sequence);
+static void take_spilled(struct ConsumerGroup *group, void **data);
+static struct ThreadQueue *oldest_sleepers_for(struct ConsumerGroup *group, int tag);
+static void terminate_sleepers(struct ThreadQueue *thread_queue, struct ThreadElement **resumed);
+static struct DataElement *create_element(void *data, int tag, const uint64_t *key, struct DataElement *spare);
+static struct StampedElement *stamped_element(struct DataElement *element);
+static void *allocate_node(struct NodeArena *arena, size_t size);
+static void free_node(struct NodeArena *arena, void *node);
+static void add_element_to_data_queue(struct DataElement *new_element);
+static void add_element_to_empty_data_queue(struct DataElement *new_element);
+static void add_element_to_nonempty_data_queue(struct DataElement *new_element);
+static void add_element_to_group(struct ConsumerGroup *group, struct DataElement *new_element);
+static void add_element_to_tag(struct TagQueue *tag_queue, struct DataElement *new_element);
+static struct DataElement *next_unread(struct ConsumerGroup *group, struct DataElement *element);
+static struct DataElement *take_matching(struct TagQueue *tag_queue, void **data);
+static void unlink_element(struct DataElement *element);
+static struct DataElement *take_from_group(struct ConsumerGroup *group, void **data);
+static struct DataElement *take_in_order(struct ConsumerGroup *group, void **data);
+static void add_to_tenant(struct Tenant *tenant, void *data);
+static size_t tenant_backlog(struct Tenant *tenant);
+static void activate_tenant(struct Tenant *tenant);
+static void deactivate_first_tenant(void);
+static struct Tenant *start_tenant_turn(void);
+static void end_tenant_turn(struct Tenant *tenant);
+static struct DataElement *take_from_tenant(struct Tenant *tenant, void **data);
+static struct DataElement *release_element(struct DataElement *element, struct ConsumerGroup *group);
+static struct DataElement *unpin_element(struct DataElement *element);
+static struct DataElement *unpin_tenant_element(struct DataElement *element);
+static struct CompactSegment *unpin_segment(struct CompactSegment *segment);
+static struct DataElement *oldest_queued(void);
+static void fill_iterator(struct QueueIterator *iterator);
+static void unpin_iterator(struct QueueIterator *iterator, struct DataElement **reclaimed, struct CompactSegment **reclaimed_segment);
+static void free_reclaimed(struct DataElement *reclaimed, struct CompactSegment *reclaimed_segment);
+static void *dequeue_from_group(struct ConsumerGroup *group);
+static bool try_dequeue_from_group(struct ConsumerGroup *group, void **element);
+static void hand_off_to_oldest_thread(struct ThreadQueue *thread_queue, void *data, struct ThreadElement **resumed);
+static void resume_waiters(struct ThreadElement *resumed);
+static bool wait_for_hand_off(struct ThreadQueue *thread_queue, const struct timespec *deadline, struct CancelToken *token, void **data);
+static void thread_enqueue(struct ThreadQueue *thread_queue, struct ThreadElement *new_element);
+static struct ThreadElement *thread_dequeue(struct ThreadQueue *thread_queue);
+static void thread_remove(struct ThreadQueue *thread_queue, struct ThreadElement *thread_element);
+static void add_element_to_thread_queue(struct ThreadQueue *thread_queue, struct ThreadElement *new_element);
+static void add_element_to_empty_thread_queue(struct ThreadQueue *thread_queue, struct ThreadElement *new_element);
+static void add_element_to_nonempty_thread_queue(struct ThreadQueue *thread_queue, struct ThreadElement *new_element);
+static void init_thread_element(struct ThreadElement *thread_element);
+static bool valid_group(int group);
+static bool valid_tag(int tag);
+static bool valid_tenant(int tenant);
+static size_t key_slot(uint64_t key);
+static struct DataElement *find_pending(uint64_t key);
+static void index_pending(struct DataElement *element);
+static void unindex_pending(struct DataElement *element);
+static bool grow_key_index(void);
+static void clear_key_index(void);
 
 void initQueue(void)
 {
+    initQueueWithOptions(NULL);
+}
+
+bool initQueueWithOptions(const struct QueueOptions *options)
+{
+    data_queue.options = options != NULL ? *options : (struct QueueOptions){0};
+    data_queue.spill_log = NULL;
+    data_queue.element_arena = NULL;
+    data_queue.segment_arena = NULL;
+    data_queue.tenants = NULL;
+    data_queue.key_index = NULL;
+    data_queue.key_index_capacity = 0;
+    data_queue.key_index_count = 0;
+    if (data_queue.options.spill_directory != NULL)
+    {
+        if (data_queue.options.serialize == NULL || data_queue.options.deserialize == NULL)
+        {
+            return false;
+        }
+        data_queue.spill_log = spill_log_open(data_queue.options.spill_directory, data_queue.options.spill_segment_size,
+                                              data_queue.options.spill_durable);
+        if (data_queue.spill_log == NULL)
+        {
+            return false;
+        }
+    }
+    if (data_queue.options.expected_depth > 0)
+    {
+        // Without huge pages or even mmap the arena is only an optimization, so the queue falls back to malloc.
+        // Slots fit either kind of element, since which one an item needs is only known as it is enqueued.
+        data_queue.element_arena = arena_create(sizeof(struct StampedElement), data_queue.options.expected_depth);
+        if (data_queue.options.compact)
+        {
+            // One spare segment beyond the depth, and one more for a run cut short by tagged items.
+            size_t segments = data_queue.options.expected_depth / QUEUE_COMPACT_SEGMENT_SLOTS + 2;
+            data_queue.segment_arena = arena_create(sizeof(struct CompactSegment), segments);
+        }
+    }
+    if (data_queue.options.tenants > 0)
+    {
+        data_queue.tenants = (struct Tenant *)malloc(data_queue.options.tenants * sizeof(struct Tenant));
+        if (data_queue.tenants == NULL)
+        {
+            release_storage();
+            return false;
+        }
+        for (size_t i = 0; i < data_queue.options.tenants; i++)
+        {
+            struct Tenant *tenant = &data_queue.tenants[i];
+            tenant->head = NULL;
+            tenant->tail = NULL;
+            tenant->queue_size = 0;
+            tenant->weight = 1;
+            tenant->deficit = 0;
+            tenant->served_count = 0;
+            tenant->next_active = NULL;
+            tenant->active = false;
+        }
+    }
+    data_queue.active_head = NULL;
+    data_queue.active_tail = NULL;
+    data_queue.tenant_items = 0;
     data_queue.head = NULL;
-    thread_queue.head = NULL;
     data_queue.tail = NULL;
-    thread_queue.tail = NULL;
-    data_queue.queue_size = 0;
-    thread_queue.waiting_count = 0;
-    data_queue.visited_count = 0;
+    data_queue.compact_head = NULL;
+    data_queue.compact_tail = NULL;
+    data_queue.compact_spare = NULL;
     data_queue.enqueued_count = 0;
+    data_queue.terminating_count = 0;
+    data_queue.group_limit = 1;
+    data_queue.sleep_tickets = 0;
+    for (int i = 0; i <= QUEUE_MAX_GROUPS; i++)
+    {
+        reset_group(&groups[i]);
+    }
+    for (int i = 0; i < QUEUE_MAX_TAGS; i++)
+    {
+        reset_tag(&tags[i]);
+    }
+    default_group->subscribed = true;
+    if (data_queue.spill_log != NULL)
+    {
+        // Items recovered from a previous run are queued ahead of anything new.
+        default_group->queue_size = spill_log_count(data_queue.spill_log);
+        if (data_queue.tenants != NULL && default_group->queue_size > 0)
+        {
+            activate_tenant(&data_queue.tenants[0]);
+        }
+    }
     mtx_init(&data_queue.data_queue_lock, mtx_plain);
+    cnd_init(&data_queue.drained);
+    cnd_init(&data_queue.spill_synced);
+    return true;
+}
+
+static void reset_group(struct ConsumerGroup *group)
+{
+    group->cursor = NULL;
+    group->queue_size = 0;
+    group->visited_count = 0;
+    group->thread_queue.head = NULL;
+    group->thread_queue.tail = NULL;
+    group->thread_queue.waiting_count = 0;
+    group->subscribed = false;
+}
+
+static void reset_tag(struct TagQueue *tag_queue)
+{
+    tag_queue->head = NULL;
+    tag_queue->tail = NULL;
+    tag_queue->queue_size = 0;
+    tag_queue->thread_queue.head = NULL;
+    tag_queue->thread_queue.tail = NULL;
+    tag_queue->thread_queue.waiting_count = 0;
+    tag_queue->completed_count = 0;
+    tag_queue->total_latency = 0;
+    tag_queue->max_latency = 0;
 }
 
 void destroyQueue(void)
 {
+    struct ThreadElement *resumed = NULL;
     mtx_lock(&data_queue.data_queue_lock);
     free_all_data_elements();
-    destroy_thread_queue();
+    for (int i = 0; i < data_queue.group_limit; i++)
+    {
+        terminate_sleepers(&groups[i].thread_queue, &resumed);
+    }
+    for (int i = 0; i < QUEUE_MAX_TAGS; i++)
+    {
+        terminate_sleepers(&tags[i].thread_queue, &resumed);
+    }
+    // Sleepers still need the lock to return from cnd_wait, so it must outlive them.
+    while (data_queue.terminating_count > 0)
+    {
+        cnd_wait(&data_queue.drained, &data_queue.data_queue_lock);
+    }
     mtx_unlock(&data_queue.data_queue_lock);
+    resume_waiters(resumed);
+    release_storage();
+    cnd_destroy(&data_queue.spill_synced);
+    cnd_destroy(&data_queue.drained);
     mtx_destroy(&data_queue.data_queue_lock);
 }
 
-void free_all_data_elements(void)
+// Closes the spill log and frees what initQueueWithOptions() allocated besides the elements.
+static void release_storage(void)
+{
+    if (data_queue.spill_log != NULL)
+    {
+        spill_log_close(data_queue.spill_log);
+        data_queue.spill_log = NULL;
+    }
+    if (data_queue.element_arena != NULL)
+    {
+        arena_destroy(data_queue.element_arena);
+        data_queue.element_arena = NULL;
+    }
+    if (data_queue.segment_arena != NULL)
+    {
+        arena_destroy(data_queue.segment_arena);
+        data_queue.segment_arena = NULL;
+    }
+    free(data_queue.tenants);
+    data_queue.tenants = NULL;
+    free(data_queue.key_index);
+    data_queue.key_index = NULL;
+    data_queue.key_index_capacity = 0;
+}
+
+static void free_all_data_elements(void)
 {
     struct DataElement *prev_head;
+    clear_key_index();
     while (data_queue.head != NULL)
     {
         prev_head = data_queue.head;
         data_queue.head = prev_head->next;
-        free(prev_head);
+        free_node(data_queue.element_arena, prev_head);
     }
+    free_compact_segments();
+    for (size_t i = 0; data_queue.tenants != NULL && i < data_queue.options.tenants; i++)
+    {
+        struct Tenant *tenant = &data_queue.tenants[i];
+        while (tenant->head != NULL)
+        {
+            prev_head = tenant->head;
+            tenant->head = prev_head->next;
+            free_node(data_queue.element_arena, prev_head);
+        }
+        tenant->tail = NULL;
+        tenant->queue_size = 0;
+        tenant->active = false;
+    }
+    data_queue.active_head = NULL;
+    data_queue.active_tail = NULL;
+    data_queue.tenant_items = 0;
     // Resetting the fields is not strictly necessary, but just for good measure.
     data_queue.tail = NULL;
-    data_queue.visited_count = 0;
-    data_queue.queue_size = 0;
     data_queue.enqueued_count = 0;
+    for (int i = 0; i < data_queue.group_limit; i++)
+    {
+        groups[i].cursor = NULL;
+        groups[i].queue_size = 0;
+        groups[i].visited_count = 0;
+    }
+    for (int i = 0; i < QUEUE_MAX_TAGS; i++)
+    {
+        tags[i].head = NULL;
+        tags[i].tail = NULL;
+        tags[i].queue_size = 0;
+    }
 }
 
-void destroy_thread_queue(void)
+static void terminate_sleepers(struct ThreadQueue *thread_queue, struct ThreadElement **resumed)
 {
-    terminator = thrd_current();
-    while (thread_queue.head != NULL)
+    // Blocked dequeuers return NULL once their group is gone, and asynchronous ones are resumed with NULL.
+    while (thread_queue->head != NULL)
     {
-        thread_queue.head->terminated = true;
-        cnd_signal(&thread_queue.head->cnd_thread);
+        struct ThreadElement *terminated_thread = thread_dequeue(thread_queue);
+        if (terminated_thread->resume != NULL)
+        {
+            terminated_thread->next = *resumed;
+            *resumed = terminated_thread;
+            continue;
+        }
+        terminated_thread->terminated = true;
+        data_queue.terminating_count++;
+        cnd_signal(&terminated_thread->cnd_thread);
     }
-    thread_queue.tail = NULL;
-    thread_queue.waiting_count = 0;
 }
 
 void enqueue(void *element_data)
 {
+    enqueue_item(QUEUE_NO_TAG, 0, element_data);
+}
+
+void enqueueTagged(int tag, void *element_data)
+{
+    enqueue_item(valid_tag(tag) ? tag : QUEUE_NO_TAG, 0, element_data);
+}
+
+void enqueueFor(int tenant, void *element_data)
+{
+    enqueue_item(QUEUE_NO_TAG, valid_tenant(tenant) ? tenant : 0, element_data);
+}
+
+void enqueueKeyed(uint64_t key, void *element_data)
+{
+    if (!data_queue.options.coalesce)
+    {
+        enqueue(element_data);
+        return;
+    }
+    QUEUE_TRACE_HOOK(uint64_t called_at = queue_trace_now());
     mtx_lock(&data_queue.data_queue_lock);
-    struct DataElement *new_element = create_element(element_data);
-    add_element_to_data_queue(new_element);
-    mtx_unlock(&data_queue.data_queue_lock);
+    QUEUE_TRACE_HOOK(queue_trace_record(QUEUE_TRACE_ENQUEUE_LOCK, called_at, queue_trace_now(), element_data));
+    struct DataElement *pending = find_pending(key);
+    if (pending != NULL)
+    {
+        // The merged item keeps the pending one's place, and nobody is waiting for it.
+        pending->data = data_queue.options.merge != NULL ? data_queue.options.merge(pending->data, element_data) : element_data;
+        mtx_unlock(&data_queue.data_queue_lock);
+        return;
+    }
+    struct ThreadElement *resumed = NULL;
+    uint64_t spilled_sequence = publish(QUEUE_NO_TAG, 0, &key, element_data, NULL, &resumed);
+    finish_enqueue(spilled_sequence, resumed);
+}
+
+static void enqueue_item(int tag, int tenant, void *element_data)
+{
+    QUEUE_TRACE_HOOK(uint64_t called_at = queue_trace_now());
+    mtx_lock(&data_queue.data_queue_lock);
+    QUEUE_TRACE_HOOK(queue_trace_record(QUEUE_TRACE_ENQUEUE_LOCK, called_at, queue_trace_now(), element_data));
+    struct ThreadElement *resumed = NULL;
+    uint64_t spilled_sequence = publish(tag, tenant, NULL, element_data, NULL, &resumed);
+    finish_enqueue(spilled_sequence, resumed);
+}
 
-    if (data_queue.queue_size > 0 && thread_queue.waiting_count > 0)
+/*
+    Must be called with the lock held. Hands the item to a sleeper or stores it, for every
+    subscribed group; a list element is built in *spare if there is one, which is then
+    cleared. Only the default group keeps a tenant's items apart, in the tenant's
+    sub-queue. A keyed item is kept in the list, and indexed if every group stored it.
+    Returns the item's spill sequence, or 0 if it was not spilled.
+*/
+static uint64_t publish(int tag, int tenant, const uint64_t *key, void *element_data, struct DataElement **spare, struct ThreadElement **resumed)
+{
+    // A broadcast is stored once, however many groups are going to read it.
+    struct DataElement *new_element = NULL;
+    uint64_t spilled_sequence = 0;
+    bool handed_off = false;
+    for (int i = 0; i < data_queue.group_limit; i++)
+    {
+        struct ConsumerGroup *group = &groups[i];
+        if (!group->subscribed)
+        {
+            continue;
+        }
+        // Sleepers are signalled under the lock, so they cannot leave their thread queue meanwhile.
+        struct ThreadQueue *sleepers = oldest_sleepers_for(group, tag);
+        if (sleepers != NULL)
+        {
+            hand_off_to_oldest_thread(sleepers, element_data, resumed);
+            handed_off = true;
+            group->visited_count++;
+            if (group == default_group && data_queue.tenants != NULL)
+            {
+                data_queue.tenants[tenant].served_count++;
+            }
+            if (group == default_group && tag != QUEUE_NO_TAG)
+            {
+                // Handed straight to a consumer, the item left its stage without waiting.
+                complete_stage(&tags[tag], queue_trace_now());
+            }
+            continue;
+        }
+        if (group == default_group && data_queue.tenants != NULL)
+        {
+            activate_tenant(&data_queue.tenants[tenant]);
+            if (tenant > 0)
+            {
+                add_to_tenant(&data_queue.tenants[tenant], element_data);
+                group->queue_size++;
+                continue;
+            }
+        }
+        if (key == NULL && should_spill(group, tag))
+        {
+            spilled_sequence = spill_log_append(data_queue.spill_log, data_queue.options.serialize, element_data);
+            group->queue_size++;
+            continue;
+        }
+        if (key == NULL && should_compact(group, tag))
+        {
+            add_to_compact_segment(element_data);
+            group->queue_size++;
+            continue;
+        }
+        if (new_element == NULL)
+        {
+            new_element = create_element(element_data, tag, key, spare != NULL ? *spare : NULL);
+            if (spare != NULL)
+            {
+                *spare = NULL;
+            }
+            add_element_to_data_queue(new_element);
+        }
+        add_element_to_group(group, new_element);
+    }
+    // A duplicate merged into an item some group was handed would never reach that group.
+    if (key != NULL && new_element != NULL && !handed_off)
     {
-        cnd_signal(&thread_queue.head->cnd_thread);
+        index_pending(new_element);
     }
+    data_queue.enqueued_count++;
+    return spilled_sequence;
 }
 
-struct DataElement *create_element(void *data)
+// Must be called with the lock held, which it releases.
+static void finish_enqueue(uint64_t spilled_sequence, struct ThreadElement *resumed)
 {
-    // We assume malloc does not fail, as per the instructions.
-    struct DataElement *element = (struct DataElement *)malloc(sizeof(struct DataElement));
-    element->data = data;
-    element->next = NULL;
-    element->index = data_queue.enqueued_count;
-    return element;
+    if (spilled_sequence > 0 && data_queue.options.spill_durable)
+    {
+        wait_until_durable(spilled_sequence);
+    }
+    mtx_unlock(&data_queue.data_queue_lock);
+    QUEUE_SCHEDULE_POINT();
+    resume_waiters(resumed);
 }
 
-void add_element_to_data_queue(struct DataElement *new_element)
+/*
+    Once an item is spilled, every later one is spilled too until the log drains, so the
+    items in memory are always older than the ones on disk. Only the default group
+    spills; subscribed groups read their copy of the item from memory as usual.
+*/
+static bool should_spill(struct ConsumerGroup *group, int tag)
 {
-    data_queue.queue_size == 0 ? add_element_to_empty_data_queue(new_element) : add_element_to_nonempty_data_queue(new_element);
+    if (data_queue.spill_log == NULL || group != default_group || tag != QUEUE_NO_TAG)
+    {
+        return false;
+    }
+    return spill_log_count(data_queue.spill_log) > 0 || group->queue_size >= data_queue.options.spill_threshold;
 }
 
-void add_element_to_empty_data_queue(struct DataElement *new_element)
+/*
+    Group commit: the first enqueuer to find its item not yet durable flushes everything
+    appended so far without holding the lock, while the enqueuers that spill meanwhile
+    wait for it and are then covered by the next flush together.
+*/
+static void wait_until_durable(uint64_t sequence)
 {
-    data_queue.head = new_element;
-    data_queue.tail = new_element;
-    data_queue.queue_size++;
-    data_queue.enqueued_count++;
+    while (spill_log_synced(data_queue.spill_log) < sequence)
+    {
+        struct SpillSync sync;
+        if (!spill_log_begin_sync(data_queue.spill_log, &sync))
+        {
+            cnd_wait(&data_queue.spill_synced, &data_queue.data_queue_lock);
+            continue;
+        }
+        mtx_unlock(&data_queue.data_queue_lock);
+        spill_log_flush(&sync);
+        mtx_lock(&data_queue.data_queue_lock);
+        spill_log_end_sync(data_queue.spill_log, &sync);
+        cnd_broadcast(&data_queue.spill_synced);
+    }
 }
 
-void add_element_to_nonempty_data_queue(struct DataElement *new_element)
+static bool should_compact(struct ConsumerGroup *group, int tag)
 {
-    data_queue.tail->next = new_element;
-    data_queue.tail = new_element;
-    data_queue.queue_size++;
-    data_queue.enqueued_count++;
+    return data_queue.options.compact && group == default_group && tag == QUEUE_NO_TAG;
 }
 
-void *dequeue(void)
+// Must be called with the lock held, before enqueued_count counts the item.
+static void add_to_compact_segment(void *data)
 {
-    mtx_lock(&data_queue.data_queue_lock);
-    // This loop blocks as required
-    while (current_thread_should_sleep())
+    struct CompactSegment *tail = data_queue.compact_tail;
+    if (tail == NULL || tail->tail == QUEUE_COMPACT_SEGMENT_SLOTS || tail->base_index + tail->tail != data_queue.enqueued_count)
     {
-        thread_enqueue();
-        struct ThreadElement *current = thread_queue.tail;
-        cnd_wait(&current->cnd_thread, &data_queue.data_queue_lock);
-        if (current->terminated)
+        struct CompactSegment *segment = data_queue.compact_spare;
+        if (segment == NULL)
+        {
+            segment = (struct CompactSegment *)allocate_node(data_queue.segment_arena, sizeof(struct CompactSegment));
+        }
+        data_queue.compact_spare = NULL;
+        segment->next = NULL;
+        segment->base_index = data_queue.enqueued_count;
+        segment->head = 0;
+        segment->tail = 0;
+        segment->pins = 0;
+        if (tail == NULL)
         {
-            struct ThreadElement *prev_head;
-            prev_head = thread_queue.head;
-            thread_queue.head = prev_head->next;
-            // Prevents runaway threads upon destruction
-            free(prev_head);
-            thrd_join(terminator, NULL);
+            data_queue.compact_head = segment;
         }
-        if (data_queue.head && get_current_first_waiting_on() <= data_queue.head->index)
+        else
         {
-            thread_dequeue();
+            tail->next = segment;
         }
+        data_queue.compact_tail = segment;
+        tail = segment;
     }
+    tail->slots[tail->tail++] = data;
+}
 
-    struct DataElement *dequeued_data = data_queue.head;
-    data_queue.head = dequeued_data->next;
-    if (data_queue.head == NULL)
+// Whether the default group's next item is the head of the compact segments rather than its cursor.
+static bool compact_is_older(struct ConsumerGroup *group)
+{
+    struct CompactSegment *head = data_queue.compact_head;
+    if (group != default_group || head == NULL)
     {
-        data_queue.tail = NULL;
+        return false;
     }
-    data_queue.queue_size--;
-    data_queue.visited_count++;
-    mtx_unlock(&data_queue.data_queue_lock);
-    void *data = dequeued_data->data;
-    free(dequeued_data);
-    return data;
+    return group->cursor == NULL || head->base_index + head->head < group->cursor->index;
 }
 
-bool current_thread_should_sleep(void)
+// Must be called with the lock held and a nonempty compact head.
+static void take_compact(struct ConsumerGroup *group, void **data)
 {
-    if (data_queue.queue_size == 0)
+    struct CompactSegment *head = data_queue.compact_head;
+    *data = head->slots[head->head++];
+    if (head->head == head->tail)
     {
-        return true;
+        data_queue.compact_head = head->next;
+        if (data_queue.compact_head == NULL)
+        {
+            data_queue.compact_tail = NULL;
+        }
+        if (head->pins == 0)
+        {
+            free_node(data_queue.segment_arena, data_queue.compact_spare);
+            data_queue.compact_spare = head;
+        }
     }
-    if (thread_queue.waiting_count <= data_queue.queue_size)
+    group->queue_size--;
+    group->visited_count++;
+}
+
+static void free_compact_segments(void)
+{
+    while (data_queue.compact_head != NULL)
     {
-        return false;
+        struct CompactSegment *next = data_queue.compact_head->next;
+        free_node(data_queue.segment_arena, data_queue.compact_head);
+        data_queue.compact_head = next;
+    }
+    data_queue.compact_tail = NULL;
+    free_node(data_queue.segment_arena, data_queue.compact_spare);
+    data_queue.compact_spare = NULL;
+}
+
+// Must be called with the lock held, once the default group has read everything in memory.
+static void take_spilled(struct ConsumerGroup *group, void **data)
+{
+    size_t length = 0;
+    const void *record = spill_log_front(data_queue.spill_log, &length);
+    *data = data_queue.options.deserialize(record, length);
+    spill_log_pop(data_queue.spill_log);
+    group->queue_size--;
+    group->visited_count++;
+}
+
+/*
+    Returns the thread queue whose oldest sleeper should be handed an item with the given
+    tag, or NULL if the group should store it. In the default group, a tagged item may go
+    to a plain sleeper or to one waiting on that tag, whichever fell asleep first.
+*/
+static struct ThreadQueue *oldest_sleepers_for(struct ConsumerGroup *group, int tag)
+{
+    struct ThreadQueue *plain = group->thread_queue.waiting_count > 0 ? &group->thread_queue : NULL;
+    if (group != default_group || tag == QUEUE_NO_TAG || tags[tag].thread_queue.waiting_count == 0)
+    {
+        return plain;
     }
-    int first_waiting_on = get_current_first_waiting_on();
-    return first_waiting_on > data_queue.head->index;
+    struct ThreadQueue *matching = &tags[tag].thread_queue;
+    return plain != NULL && plain->head->ticket < matching->head->ticket ? plain : matching;
 }
 
-int get_current_first_waiting_on(void)
+/*
+    Reuses spare if it is not NULL, sparing a pipeline stage the free and malloc of moving
+    an item on; a spare was taken by its tag, so it is always large enough to be stamped.
+*/
+static struct DataElement *create_element(void *data, int tag, const uint64_t *key, struct DataElement *spare)
 {
-    struct ThreadElement *thread_element = thread_queue.head;
-    while (thread_element != NULL)
+    bool stamped = tag != QUEUE_NO_TAG || key != NULL || data_queue.options.track_ages;
+    QUEUE_TRACE_HOOK(stamped = true);
+    size_t size = stamped ? sizeof(struct StampedElement) : sizeof(struct DataElement);
+    struct DataElement *element = spare != NULL ? spare : (struct DataElement *)allocate_node(data_queue.element_arena, size);
+    element->data = data;
+    element->next = NULL;
+    element->prev = NULL;
+    element->index = data_queue.enqueued_count;
+    element->tag = tag;
+    element->readers = 0;
+    element->pins = 0;
+    element->keyed = false;
+    element->stamped = stamped;
+    if (stamped)
     {
-        if (thrd_equal(thrd_current(), thread_element->id))
+        struct StampedElement *stamped_fields = stamped_element(element);
+        if (key != NULL)
+        {
+            stamped_fields->key = *key;
+        }
+        else
         {
-            return thread_element->waiting_on;
+            stamped_fields->next_same_tag = NULL;
         }
-        thread_element = thread_element->next;
+        stamped_fields->enqueued_at = queue_trace_now();
     }
-    return -1;
+    return element;
 }
 
-void thread_enqueue(void)
+// Must only be called on an element created stamped.
+static struct StampedElement *stamped_element(struct DataElement *element)
 {
-    struct ThreadElement *new_thread_element = create_thread_element();
-    add_element_to_thread_queue(new_thread_element);
+    return (struct StampedElement *)element;
 }
 
-void thread_dequeue(void)
+// Must be called with the lock held. Takes a node from the arena if there is one with room, else from malloc.
+static void *allocate_node(struct NodeArena *arena, size_t size)
 {
-    struct ThreadElement *dequeued_thread = thread_queue.head;
-    thread_queue.head = thread_queue.head->next;
-    free(dequeued_thread);
-    if (thread_queue.head == NULL)
+    void *node = arena != NULL ? arena_alloc(arena) : NULL;
+    if (node == NULL)
     {
-        thread_queue.tail = NULL;
+        // We assume malloc does not fail, as per the instructions.
+        node = malloc(size);
     }
-    thread_queue.waiting_count--;
+    return node;
 }
 
-void add_element_to_thread_queue(struct ThreadElement *new_element)
+// May be called without the lock, like free, so reclaimed elements are still freed after unlocking.
+static void free_node(struct NodeArena *arena, void *node)
 {
-    thread_queue.waiting_count == 0 ? add_element_to_empty_thread_queue(new_element) : add_element_to_nonempty_thread_queue(new_element);
+    if (arena != NULL && arena_owns(arena, node))
+    {
+        arena_free(arena, node);
+    }
+    else
+    {
+        free(node);
+    }
 }
 
-void add_element_to_empty_thread_queue(struct ThreadElement *new_element)
+static void add_element_to_data_queue(struct DataElement *new_element)
 {
-    thread_queue.head = new_element;
-    thread_queue.tail = new_element;
-    thread_queue.waiting_count++;
+    data_queue.head == NULL ? add_element_to_empty_data_queue(new_element) : add_element_to_nonempty_data_queue(new_element);
 }
 
-void add_element_to_nonempty_thread_queue(struct ThreadElement *new_element)
+// Only groups without sleepers read the element; the others were handed the item already.
+static void add_element_to_group(struct ConsumerGroup *group, struct DataElement *new_element)
 {
-    thread_queue.tail->next = new_element;
-    thread_queue.tail = new_element;
-    thread_queue.waiting_count++;
+    if (group->cursor == NULL)
+    {
+        group->cursor = new_element;
+    }
+    group->queue_size++;
+    new_element->readers |= group_bit(group);
+    if (group == default_group && new_element->tag != QUEUE_NO_TAG)
+    {
+        add_element_to_tag(&tags[new_element->tag], new_element);
+    }
 }
 
-struct ThreadElement *create_thread_element(void)
+static void add_element_to_tag(struct TagQueue *tag_queue, struct DataElement *new_element)
 {
-    struct ThreadElement *thread_element = (struct ThreadElement *)malloc(sizeof(struct ThreadElement));
-    thread_element->id = thrd_current();
-    thread_element->next = NULL;
-    thread_element->terminated = false;
-    cnd_init(&thread_element->cnd_thread);
-    thread_element->waiting_on = data_queue.enqueued_count + thread_queue.waiting_count;
-    return thread_element;
+    if (tag_queue->head == NULL)
+    {
+        tag_queue->head = new_element;
+    }
+    else
+    {
+        stamped_element(tag_queue->tail)->next_same_tag = new_element;
+    }
+    tag_queue->tail = new_element;
+    tag_queue->queue_size++;
 }
 
-bool tryDequeue(void **element)
+static void add_element_to_empty_data_queue(struct DataElement *new_element)
 {
-    mtx_lock(&data_queue.data_queue_lock);
-    while (data_queue.queue_size == 0 || data_queue.head == NULL)
+    data_queue.head = new_element;
+    data_queue.tail = new_element;
+}
+
+static void add_element_to_nonempty_data_queue(struct DataElement *new_element)
+{
+    data_queue.tail->next = new_element;
+    new_element->prev = data_queue.tail;
+    data_queue.tail = new_element;
+}
+
+/*
+    Must be called with the lock held and a nonempty group. Returns the element once
+    every group has read it, for the caller to free after unlocking.
+*/
+static struct DataElement *take_from_group(struct ConsumerGroup *group, void **data)
+{
+    if (group != default_group || data_queue.tenants == NULL)
     {
-        mtx_unlock(&data_queue.data_queue_lock);
-        return false;
+        return take_in_order(group, data);
     }
-    struct DataElement *dequeued_data = data_queue.head;
-    data_queue.head = dequeued_data->next;
-    if (data_queue.head == NULL)
+    struct Tenant *tenant = start_tenant_turn();
+    struct DataElement *reclaimed = tenant == data_queue.tenants ? take_in_order(group, data) : take_from_tenant(tenant, data);
+    end_tenant_turn(tenant);
+    return reclaimed;
+}
+
+// The group's oldest item, which for the default group in fair mode is tenant 0's.
+static struct DataElement *take_in_order(struct ConsumerGroup *group, void **data)
+{
+    if (compact_is_older(group))
     {
-        data_queue.tail = NULL;
+        take_compact(group, data);
+        return NULL;
     }
-    data_queue.queue_size--;
-    data_queue.visited_count++;
-    mtx_unlock(&data_queue.data_queue_lock);
-    *element = (void *)dequeued_data->data;
-    free(dequeued_data);
-    return true;
+    if (group->cursor == NULL)
+    {
+        // Besides compact segments, only the default group's spilled items are counted without being in the list.
+        take_spilled(group, data);
+        return NULL;
+    }
+    struct DataElement *element = group->cursor;
+    if (element->keyed)
+    {
+        // Once one group has read it, the item is no longer pending, and duplicates are appended.
+        unindex_pending(element);
+    }
+    group->cursor = next_unread(group, element->next);
+    group->queue_size--;
+    group->visited_count++;
+    if (group == default_group && element->tag != QUEUE_NO_TAG)
+    {
+        // The oldest unread element of the default group is also the oldest with its tag.
+        struct TagQueue *tag_queue = &tags[element->tag];
+        tag_queue->head = stamped_element(element)->next_same_tag;
+        if (tag_queue->head == NULL)
+        {
+            tag_queue->tail = NULL;
+        }
+        tag_queue->queue_size--;
+        complete_stage(tag_queue, stamped_element(element)->enqueued_at);
+    }
+    *data = element->data;
+    QUEUE_TRACE_HOOK(queue_trace_record(QUEUE_TRACE_QUEUED, stamped_element(element)->enqueued_at, queue_trace_now(), element->data));
+    return release_element(element, group);
 }
 
-size_t size(void)
+// Must be called with the lock held, in fair mode.
+static void add_to_tenant(struct Tenant *tenant, void *data)
 {
-    return data_queue.queue_size;
+    struct DataElement *element = create_element(data, QUEUE_NO_TAG, NULL, NULL);
+    // Only the default group reads the sub-queue, and iterators tell a taken element by its bit.
+    element->readers = group_bit(default_group);
+    if (tenant->head == NULL)
+    {
+        tenant->head = element;
+    }
+    else
+    {
+        tenant->tail->next = element;
+    }
+    tenant->tail = element;
+    tenant->queue_size++;
+    data_queue.tenant_items++;
 }
 
-size_t waiting(void)
+static size_t tenant_backlog(struct Tenant *tenant)
 {
-    return thread_queue.waiting_count;
+    return tenant == data_queue.tenants ? default_group->queue_size - data_queue.tenant_items : tenant->queue_size;
 }
 
-size_t visited(void)
+// Queues the tenant for a turn unless it already has one coming.
+static void activate_tenant(struct Tenant *tenant)
 {
-    return data_queue.visited_count;
-}
\ No newline at end of file
+    if (tenant->active)
+    {
+        return;
+    }
+    tenant->active = true;
+    tenant->next_active = NULL;
+    if (data_queue.active_tail == NULL)
+    {
+        data_queue.active_head = tenant;
+    }
+    else
+    {
+        data_queue.active_tail->next_active = tenant;
+    }
+    data_queue.active_tail = tenant;
+}
+
+static void deactivate_first_tenant(void)
+{
+    struct Tenant *first = data_queue.active_head;
+    data_queue.active_head = first->next_active;
+    if (data_queue.active_head == NULL)
+    {
+        data_queue.active_tail = NULL;
+    }
+    first->active = false;
+    first->deficit = 0;
+}
+
+/*
+    Must be called with the lock held and a nonempty default group. Returns the tenant
+    whose turn it is; a tenant starting its turn is credited its weight in items. Every
+    turn takes at least one item, so this is O(1) however many tenants there are.
+*/
+static struct Tenant *start_tenant_turn(void)
+{
+    // Tenant 0 stays in the ring when dequeueMatching takes its last items, so it may be found empty.
+    while (tenant_backlog(data_queue.active_head) == 0)
+    {
+        deactivate_first_tenant();
+    }
+    struct Tenant *tenant = data_queue.active_head;
+    if (tenant->deficit == 0)
+    {
+        tenant->deficit = tenant->weight;
+    }
+    return tenant;
+}
+
+// Ends the turn once the tenant has used up its credit or its items, moving it to the back if it has more.
+static void end_tenant_turn(struct Tenant *tenant)
+{
+    tenant->served_count++;
+    if (--tenant->deficit > 0 && tenant_backlog(tenant) > 0)
+    {
+        return;
+    }
+    deactivate_first_tenant();
+    if (tenant_backlog(tenant) > 0)
+    {
+        activate_tenant(tenant);
+    }
+}
+
+/*
+    Must be called with the lock held and a nonempty tenant. The element is only in the
+    sub-queue, so it is returned to be freed at once unless an iterator pinned it.
+*/
+static struct DataElement *take_from_tenant(struct Tenant *tenant, void **data)
+{
+    struct DataElement *element = tenant->head;
+    tenant->head = element->next;
+    if (tenant->head == NULL)
+    {
+        tenant->tail = NULL;
+    }
+    tenant->queue_size--;
+    data_queue.tenant_items--;
+    default_group->queue_size--;
+    default_group->visited_count++;
+    *data = element->data;
+    QUEUE_TRACE_HOOK(queue_trace_record(QUEUE_TRACE_QUEUED, stamped_element(element)->enqueued_at, queue_trace_now(), element->data));
+    element->readers = 0;
+    return element->pins > 0 ? NULL : element;
+}
+
+// Skips the elements the group did not store, or that the default group already took by their tag.
+static struct DataElement *next_unread(struct ConsumerGroup *group, struct DataElement *element)
+{
+    while (element != NULL && (element->readers & group_bit(group)) == 0)
+    {
+        element = element->next;
+    }
+    return element;
+}
+
+// Must be called with the lock held and a nonempty tag queue.
+static struct DataElement *take_matching(struct TagQueue *tag_queue, void **data)
+{
+    struct DataElement *element = tag_queue->head;
+    tag_queue->head = stamped_element(element)->next_same_tag;
+    if (tag_queue->head == NULL)
+    {
+        tag_queue->tail = NULL;
+    }
+    tag_queue->queue_size--;
+    default_group->queue_size--;
+    default_group->visited_count++;
+    // Ahead of the cursor, the element is skipped later on, once its bit is cleared.
+    if (default_group->cursor == element)
+    {
+        default_group->cursor = next_unread(default_group, element->next);
+    }
+    complete_stage(tag_queue, stamped_element(element)->enqueued_at);
+    if (data_queue.tenants != NULL)
+    {
+        data_queue.tenants[0].served_count++;
+    }
+    *data = element->data;
+    QUEUE_TRACE_HOOK(queue_trace_record(QUEUE_TRACE_QUEUED, stamped_element(element)->enqueued_at, queue_trace_now(), element->data));
+    return release_element(element, default_group);
+}
+
+static void complete_stage(struct TagQueue *tag_queue, uint64_t enqueued_at)
+{
+    uint64_t latency = queue_trace_now() - enqueued_at;
+    tag_queue->completed_count++;
+    tag_queue->total_latency += latency;
+    if (latency > tag_queue->max_latency)
+    {
+        tag_queue->max_latency = latency;
+    }
+}
+
+/*
+    Marks the element read by the group. Returns it once every group has read it and no
+    iterator holds it, for the caller to free after unlocking. No cursor can point at it
+    by then, since all of its readers have passed it.
+*/
+static struct DataElement *release_element(struct DataElement *element, struct ConsumerGroup *group)
+{
+    element->readers &= ~group_bit(group);
+    if (element->readers != 0 || element->pins > 0)
+    {
+        return NULL;
+    }
+    unlink_element(element);
+    return element;
+}
+
+// Like release_element, for an iterator moving on from the element it pinned.
+static struct DataElement *unpin_element(struct DataElement *element)
+{
+    if (--element->pins > 0 || element->readers != 0)
+    {
+        return NULL;
+    }
+    unlink_element(element);
+    return element;
+}
+
+// Like unpin_element, for an element of a tenant's sub-queue, which is not in the list.
+static struct DataElement *unpin_tenant_element(struct DataElement *element)
+{
+    return --element->pins > 0 || element->readers != 0 ? NULL : element;
+}
+
+// Returns the segment once no iterator holds it and it was emptied, for the caller to free after unlocking.
+static struct CompactSegment *unpin_segment(struct CompactSegment *segment)
+{
+    return --segment->pins > 0 || segment->head < segment->tail ? NULL : segment;
+}
+
+static void unlink_element(struct DataElement *element)
+{
+    if (element->prev == NULL)
+    {
+        data_queue.head = element->next;
+    }
+    else
+    {
+        element->prev->next = element->next;
+    }
+    if (element->next == NULL)
+    {
+        data_queue.tail = element->prev;
+    }
+    else
+    {
+        element->next->prev = element->prev;
+    }
+}
+
+/*
+    Must be called with the lock held and at least one sleeping thread. An asynchronous
+    waiter is added to resumed instead, since its callback must run without the lock.
+*/
+static void hand_off_to_oldest_thread(struct ThreadQueue *thread_queue, void *data, struct ThreadElement **resumed)
+{
+    struct ThreadElement *oldest = thread_dequeue(thread_queue);
+    oldest->data = data;
+    oldest->delivered = true;
+    QUEUE_TRACE_HOOK(oldest->handed_off_at = queue_trace_now());
+    if (oldest->resume != NULL)
+    {
+        oldest->next = *resumed;
+        *resumed = oldest;
+        return;
+    }
+    cnd_signal(&oldest->cnd_thread);
+}
+
+// Must be called without the lock held, since the callbacks may use the queue again.
+static void resume_waiters(struct ThreadElement *resumed)
+{
+    while (resumed != NULL)
+    {
+        struct ThreadElement *next = resumed->next;
+#ifdef QUEUE_TRACE
+        if (resumed->delivered)
+        {
+            queue_trace_record(QUEUE_TRACE_WAKEUP, resumed->handed_off_at, queue_trace_now(), resumed->data);
+        }
+#endif
+        resumed->resume(resumed->context, resumed->data, resumed->delivered);
+        free(resumed);
+        resumed = next;
+    }
+}
+
+void *dequeue(void)
+{
+    return dequeue_from_group(default_group);
+}
+
+static void *dequeue_from_group(struct ConsumerGroup *group)
+{
+    QUEUE_TRACE_HOOK(uint64_t called_at = queue_trace_now());
+    mtx_lock(&data_queue.data_queue_lock);
+    QUEUE_TRACE_HOOK(queue_trace_record(QUEUE_TRACE_DEQUEUE_LOCK, called_at, queue_trace_now(), NULL));
+    if (!group->subscribed)
+    {
+        mtx_unlock(&data_queue.data_queue_lock);
+        return NULL;
+    }
+    if (group->queue_size == 0)
+    {
+        void *handed_off;
+        wait_for_hand_off(&group->thread_queue, NULL, NULL, &handed_off);
+        mtx_unlock(&data_queue.data_queue_lock);
+        QUEUE_SCHEDULE_POINT();
+        return handed_off;
+    }
+    void *data;
+    struct DataElement *reclaimed = take_from_group(group, &data);
+    mtx_unlock(&data_queue.data_queue_lock);
+    QUEUE_SCHEDULE_POINT();
+    free_node(data_queue.element_arena, reclaimed);
+    return data;
+}
+
+/*
+    Must be called with the lock held and an empty group. Returns whether an item was
+    handed off; if not, data is NULL and the queue was destroyed, the deadline passed or
+    the token was cancelled.
+*/
+static bool wait_for_hand_off(struct ThreadQueue *thread_queue, const struct timespec *deadline, struct CancelToken *token, void **data)
+{
+    struct ThreadElement current;
+    init_thread_element(&current);
+    cnd_init(&current.cnd_thread);
+    current.ticket = data_queue.sleep_tickets++;
+    thread_enqueue(thread_queue, &current);
+    if (token != NULL)
+    {
+        token->waiter = &current;
+        token->thread_queue = thread_queue;
+    }
+    QUEUE_TRACE_HOOK(uint64_t slept_at = queue_trace_now());
+    // This loop blocks as required; it also absorbs spurious wakeups.
+    while (!current.delivered && !current.terminated && !current.cancelled)
+    {
+        if (deadline == NULL)
+        {
+            cnd_wait(&current.cnd_thread, &data_queue.data_queue_lock);
+        }
+        else if (cnd_timedwait(&current.cnd_thread, &data_queue.data_queue_lock, deadline) == thrd_timedout &&
+                 !current.delivered && !current.terminated)
+        {
+            // Nobody has picked us yet, and under the lock nobody can until we have left.
+            thread_remove(thread_queue, &current);
+            break;
+        }
+    }
+    cnd_destroy(&current.cnd_thread);
+    if (token != NULL)
+    {
+        token->waiter = NULL;
+    }
+#ifdef QUEUE_TRACE
+    if (current.delivered)
+    {
+        // The wakeup includes reacquiring the lock, which the sleeper needs before it can return.
+        queue_trace_record(QUEUE_TRACE_BLOCKED, slept_at, current.handed_off_at, current.data);
+        queue_trace_record(QUEUE_TRACE_WAKEUP, current.handed_off_at, queue_trace_now(), current.data);
+    }
+#endif
+    if (current.terminated && --data_queue.terminating_count == 0)
+    {
+        cnd_signal(&data_queue.drained);
+    }
+    *data = current.data;
+    return current.delivered;
+}
+
+static void thread_enqueue(struct ThreadQueue *thread_queue, struct ThreadElement *new_element)
+{
+    add_element_to_thread_queue(thread_queue, new_element);
+}
+
+static struct ThreadElement *thread_dequeue(struct ThreadQueue *thread_queue)
+{
+    struct ThreadElement *dequeued_thread = thread_queue->head;
+    thread_remove(thread_queue, dequeued_thread);
+    return dequeued_thread;
+}
+
+static void thread_remove(struct ThreadQueue *thread_queue, struct ThreadElement *thread_element)
+{
+    if (thread_element->prev == NULL)
+    {
+        thread_queue->head = thread_element->next;
+    }
+    else
+    {
+        thread_element->prev->next = thread_element->next;
+    }
+    if (thread_element->next == NULL)
+    {
+        thread_queue->tail = thread_element->prev;
+    }
+    else
+    {
+        thread_element->next->prev = thread_element->prev;
+    }
+    // Callers reuse next, e.g. to chain waiters that are resumed after unlocking.
+    thread_element->next = NULL;
+    thread_element->prev = NULL;
+    thread_queue->waiting_count--;
+}
+
+static void add_element_to_thread_queue(struct ThreadQueue *thread_queue, struct ThreadElement *new_element)
+{
+    thread_queue->waiting_count == 0 ? add_element_to_empty_thread_queue(thread_queue, new_element) : add_element_to_nonempty_thread_queue(thread_queue, new_element);
+}
+
+static void add_element_to_empty_thread_queue(struct ThreadQueue *thread_queue, struct ThreadElement *new_element)
+{
+    new_element->prev = NULL;
+    thread_queue->head = new_element;
+    thread_queue->tail = new_element;
+    thread_queue->waiting_count++;
+}
+
+static void add_element_to_nonempty_thread_queue(struct ThreadQueue *thread_queue, struct ThreadElement *new_element)
+{
+    thread_queue->tail->next = new_element;
+    new_element->prev = thread_queue->tail;
+    thread_queue->tail = new_element;
+    thread_queue->waiting_count++;
+}
+
+static void init_thread_element(struct ThreadElement *thread_element)
+{
+    thread_element->next = NULL;
+    thread_element->prev = NULL;
+    thread_element->terminated = false;
+    thread_element->cancelled = false;
+    thread_element->delivered = false;
+    thread_element->data = NULL;
+    thread_element->resume = NULL;
+    thread_element->context = NULL;
+}
+
+bool tryDequeue(void **element)
+{
+    return try_dequeue_from_group(default_group, element);
+}
+
+size_t dequeueBatch(void **items, size_t max, const struct timespec *deadline)
+{
+    if (max == 0)
+    {
+        return 0;
+    }
+    QUEUE_TRACE_HOOK(uint64_t called_at = queue_trace_now());
+    mtx_lock(&data_queue.data_queue_lock);
+    QUEUE_TRACE_HOOK(queue_trace_record(QUEUE_TRACE_DEQUEUE_LOCK, called_at, queue_trace_now(), NULL));
+    size_t count = 0;
+    if (default_group->queue_size == 0)
+    {
+        if (!wait_for_hand_off(&default_group->thread_queue, deadline, NULL, &items[0]))
+        {
+            mtx_unlock(&data_queue.data_queue_lock);
+            return 0;
+        }
+        // Whatever was enqueued while we were waking up is ours to take along.
+        count++;
+    }
+    // Elements nobody else needs are chained through next, to be freed after unlocking.
+    struct DataElement *reclaimed = NULL;
+    while (count < max && default_group->queue_size > 0)
+    {
+        struct DataElement *element = take_from_group(default_group, &items[count++]);
+        if (element != NULL)
+        {
+            element->next = reclaimed;
+            reclaimed = element;
+        }
+    }
+    mtx_unlock(&data_queue.data_queue_lock);
+    QUEUE_SCHEDULE_POINT();
+    while (reclaimed != NULL)
+    {
+        struct DataElement *next = reclaimed->next;
+        free_node(data_queue.element_arena, reclaimed);
+        reclaimed = next;
+    }
+    return count;
+}
+
+void initCancelToken(struct CancelToken *token)
+{
+    token->cancelled = false;
+    token->waiter = NULL;
+    token->thread_queue = NULL;
+}
+
+void cancelDequeue(struct CancelToken *token)
+{
+    mtx_lock(&data_queue.data_queue_lock);
+    token->cancelled = true;
+    struct ThreadElement *waiter = (struct ThreadElement *)token->waiter;
+    // A waiter that was already handed its item has left its thread queue, and keeps the item.
+    if (waiter != NULL && !waiter->delivered && !waiter->terminated && !waiter->cancelled)
+    {
+        thread_remove((struct ThreadQueue *)token->thread_queue, waiter);
+        waiter->cancelled = true;
+        cnd_signal(&waiter->cnd_thread);
+    }
+    mtx_unlock(&data_queue.data_queue_lock);
+}
+
+bool dequeueCancellable(void **element, struct CancelToken *token)
+{
+    mtx_lock(&data_queue.data_queue_lock);
+    if (token->cancelled)
+    {
+        mtx_unlock(&data_queue.data_queue_lock);
+        return false;
+    }
+    if (default_group->queue_size == 0)
+    {
+        bool delivered = wait_for_hand_off(&default_group->thread_queue, NULL, token, element);
+        mtx_unlock(&data_queue.data_queue_lock);
+        QUEUE_SCHEDULE_POINT();
+        return delivered;
+    }
+    struct DataElement *reclaimed = take_from_group(default_group, element);
+    mtx_unlock(&data_queue.data_queue_lock);
+    QUEUE_SCHEDULE_POINT();
+    free_node(data_queue.element_arena, reclaimed);
+    return true;
+}
+
+bool dequeueAsync(void **element, queue_resume_fn resume, void *context)
+{
+    mtx_lock(&data_queue.data_queue_lock);
+    if (default_group->queue_size > 0)
+    {
+        struct DataElement *reclaimed = take_from_group(default_group, element);
+        mtx_unlock(&data_queue.data_queue_lock);
+        free_node(data_queue.element_arena, reclaimed);
+        return true;
+    }
+    // The waiter joins the same thread queue as blocked threads, so it is served in the same FIFO order.
+    struct ThreadElement *waiter = (struct ThreadElement *)malloc(sizeof(struct ThreadElement));
+    init_thread_element(waiter);
+    waiter->resume = resume;
+    waiter->context = context;
+    waiter->ticket = data_queue.sleep_tickets++;
+    thread_enqueue(&default_group->thread_queue, waiter);
+    mtx_unlock(&data_queue.data_queue_lock);
+    return false;
+}
+
+static bool try_dequeue_from_group(struct ConsumerGroup *group, void **element)
+{
+    mtx_lock(&data_queue.data_queue_lock);
+    if (!group->subscribed || group->queue_size == 0)
+    {
+        mtx_unlock(&data_queue.data_queue_lock);
+        return false;
+    }
+    struct DataElement *reclaimed = take_from_group(group, element);
+    mtx_unlock(&data_queue.data_queue_lock);
+    free_node(data_queue.element_arena, reclaimed);
+    return true;
+}
+
+size_t size(void)
+{
+    return default_group->queue_size;
+}
+
+size_t waiting(void)
+{
+    size_t waiting_count = default_group->thread_queue.waiting_count;
+    for (int i = 0; i < QUEUE_MAX_TAGS; i++)
+    {
+        waiting_count += tags[i].thread_queue.waiting_count;
+    }
+    return waiting_count;
+}
+
+size_t visited(void)
+{
+    return default_group->visited_count;
+}
+
+int subscribeGroup(void)
+{
+    mtx_lock(&data_queue.data_queue_lock);
+    int group = 1;
+    while (group <= QUEUE_MAX_GROUPS && groups[group].subscribed)
+    {
+        group++;
+    }
+    if (group > QUEUE_MAX_GROUPS)
+    {
+        mtx_unlock(&data_queue.data_queue_lock);
+        return -1;
+    }
+    // A new group starts at the tail: it only sees items enqueued from now on.
+    reset_group(&groups[group]);
+    // It would miss duplicates merged into items pending from before it, so those must no longer take any.
+    clear_key_index();
+    groups[group].subscribed = true;
+    if (group >= data_queue.group_limit)
+    {
+        data_queue.group_limit = group + 1;
+    }
+    mtx_unlock(&data_queue.data_queue_lock);
+    return group;
+}
+
+void unsubscribeGroup(int group)
+{
+    mtx_lock(&data_queue.data_queue_lock);
+    struct ConsumerGroup *unsubscribed = valid_group(group) ? &groups[group] : NULL;
+    if (unsubscribed == NULL || unsubscribed == default_group || !unsubscribed->subscribed)
+    {
+        mtx_unlock(&data_queue.data_queue_lock);
+        return;
+    }
+    struct ThreadElement *resumed = NULL;
+    terminate_sleepers(&unsubscribed->thread_queue, &resumed);
+    // Give up our claim on everything we have not read, reclaiming what nobody else needs.
+    struct DataElement *element = unsubscribed->cursor;
+    while (element != NULL)
+    {
+        struct DataElement *next = next_unread(unsubscribed, element->next);
+        free_node(data_queue.element_arena, release_element(element, unsubscribed));
+        element = next;
+    }
+    unsubscribed->cursor = NULL;
+    unsubscribed->queue_size = 0;
+    unsubscribed->subscribed = false;
+    while (data_queue.group_limit > 1 && !groups[data_queue.group_limit - 1].subscribed)
+    {
+        data_queue.group_limit--;
+    }
+    mtx_unlock(&data_queue.data_queue_lock);
+    resume_waiters(resumed);
+}
+
+// Dequeuing from a group that is not subscribed returns NULL, like a destroyed queue.
+void *dequeueGroup(int group)
+{
+    return valid_group(group) ? dequeue_from_group(&groups[group]) : NULL;
+}
+
+bool tryDequeueGroup(int group, void **element)
+{
+    return valid_group(group) && try_dequeue_from_group(&groups[group], element);
+}
+
+size_t sizeGroup(int group)
+{
+    return valid_group(group) ? groups[group].queue_size : 0;
+}
+
+static bool valid_group(int group)
+{
+    return group >= 0 && group <= QUEUE_MAX_GROUPS;
+}
+
+void *dequeueMatching(int tag)
+{
+    if (!valid_tag(tag))
+    {
+        return NULL;
+    }
+    struct TagQueue *tag_queue = &tags[tag];
+    QUEUE_TRACE_HOOK(uint64_t called_at = queue_trace_now());
+    mtx_lock(&data_queue.data_queue_lock);
+    QUEUE_TRACE_HOOK(queue_trace_record(QUEUE_TRACE_DEQUEUE_LOCK, called_at, queue_trace_now(), NULL));
+    if (tag_queue->queue_size == 0)
+    {
+        void *handed_off;
+        wait_for_hand_off(&tag_queue->thread_queue, NULL, NULL, &handed_off);
+        mtx_unlock(&data_queue.data_queue_lock);
+        QUEUE_SCHEDULE_POINT();
+        return handed_off;
+    }
+    void *data;
+    struct DataElement *reclaimed = take_matching(tag_queue, &data);
+    mtx_unlock(&data_queue.data_queue_lock);
+    QUEUE_SCHEDULE_POINT();
+    free_node(data_queue.element_arena, reclaimed);
+    return data;
+}
+
+bool tryDequeueMatching(int tag, void **element)
+{
+    if (!valid_tag(tag))
+    {
+        return false;
+    }
+    mtx_lock(&data_queue.data_queue_lock);
+    if (tags[tag].queue_size == 0)
+    {
+        mtx_unlock(&data_queue.data_queue_lock);
+        return false;
+    }
+    struct DataElement *reclaimed = take_matching(&tags[tag], element);
+    mtx_unlock(&data_queue.data_queue_lock);
+    free_node(data_queue.element_arena, reclaimed);
+    return true;
+}
+
+size_t sizeMatching(int tag)
+{
+    return valid_tag(tag) ? tags[tag].queue_size : 0;
+}
+
+void *forwardMatching(int to_tag, void *element, int from_tag)
+{
+    to_tag = valid_tag(to_tag) ? to_tag : QUEUE_NO_TAG;
+    QUEUE_TRACE_HOOK(uint64_t called_at = queue_trace_now());
+    mtx_lock(&data_queue.data_queue_lock);
+    QUEUE_TRACE_HOOK(queue_trace_record(QUEUE_TRACE_DEQUEUE_LOCK, called_at, queue_trace_now(), element));
+    // Taking first frees a node, if this stage was its last reader, for the item moving on to reuse.
+    void *next = NULL;
+    struct DataElement *spare = NULL;
+    bool taken = valid_tag(from_tag) && tags[from_tag].queue_size > 0;
+    if (taken)
+    {
+        spare = take_matching(&tags[from_tag], &next);
+    }
+    struct ThreadElement *resumed = NULL;
+    uint64_t spilled_sequence = publish(to_tag, 0, NULL, element, &spare, &resumed);
+    if (spilled_sequence > 0 && data_queue.options.spill_durable)
+    {
+        wait_until_durable(spilled_sequence);
+    }
+    struct DataElement *reclaimed = NULL;
+    if (!taken && valid_tag(from_tag))
+    {
+        if (resumed != NULL)
+        {
+            // Asynchronous waiters of the next stage must not wait for this one to get an item.
+            mtx_unlock(&data_queue.data_queue_lock);
+            resume_waiters(resumed);
+            resumed = NULL;
+            mtx_lock(&data_queue.data_queue_lock);
+        }
+        if (tags[from_tag].queue_size > 0)
+        {
+            reclaimed = take_matching(&tags[from_tag], &next);
+        }
+        else
+        {
+            wait_for_hand_off(&tags[from_tag].thread_queue, NULL, NULL, &next);
+        }
+    }
+    mtx_unlock(&data_queue.data_queue_lock);
+    QUEUE_SCHEDULE_POINT();
+    resume_waiters(resumed);
+    free_node(data_queue.element_arena, spare);
+    free_node(data_queue.element_arena, reclaimed);
+    return next;
+}
+
+bool stageStats(int tag, struct StageStats *stats)
+{
+    if (!valid_tag(tag))
+    {
+        return false;
+    }
+    mtx_lock(&data_queue.data_queue_lock);
+    struct TagQueue *tag_queue = &tags[tag];
+    stats->depth = tag_queue->queue_size;
+    stats->waiting = tag_queue->thread_queue.waiting_count;
+    stats->completed = tag_queue->completed_count;
+    stats->mean_latency_ns = tag_queue->completed_count > 0 ? (double)tag_queue->total_latency / tag_queue->completed_count : 0;
+    stats->max_latency_ns = tag_queue->max_latency;
+    mtx_unlock(&data_queue.data_queue_lock);
+    return true;
+}
+
+/*
+    The oldest item may be in the list, the compact segments or a tenant's sub-queue. A
+    subscribed group's copy in the list shares its index with the default group's copy
+    elsewhere, so comparing indices finds the oldest either way.
+*/
+bool peek(void **element, uint64_t *age_ns)
+{
+    mtx_lock(&data_queue.data_queue_lock);
+    struct DataElement *oldest = oldest_queued();
+    unsigned long oldest_index = oldest != NULL ? oldest->index : ULONG_MAX;
+    void *data = oldest != NULL ? oldest->data : NULL;
+    bool found = oldest != NULL;
+    struct CompactSegment *segment = data_queue.compact_head;
+    if (segment != NULL && segment->base_index + segment->head < oldest_index)
+    {
+        // Compact slots hold nothing but the item.
+        oldest = NULL;
+        oldest_index = segment->base_index + segment->head;
+        data = segment->slots[segment->head];
+        found = true;
+    }
+    // Every tenant with items is in the ring, so only those are looked at.
+    for (struct Tenant *tenant = data_queue.active_head; tenant != NULL; tenant = tenant->next_active)
+    {
+        if (tenant->head != NULL && tenant->head->index < oldest_index)
+        {
+            oldest = tenant->head;
+            oldest_index = oldest->index;
+            data = oldest->data;
+            found = true;
+        }
+    }
+    if (found)
+    {
+        *element = data;
+        if (age_ns != NULL)
+        {
+            *age_ns = oldest != NULL && oldest->stamped ? queue_trace_now() - stamped_element(oldest)->enqueued_at : QUEUE_AGE_UNKNOWN;
+        }
+    }
+    mtx_unlock(&data_queue.data_queue_lock);
+    return found;
+}
+
+// Must be called with the lock held. Skips the elements that are only still listed for an iterator.
+static struct DataElement *oldest_queued(void)
+{
+    struct DataElement *element = data_queue.head;
+    while (element != NULL && element->readers == 0)
+    {
+        element = element->next;
+    }
+    return element;
+}
+
+/*
+    Pins where each walk starts: the list's head, the compact head and the head of every
+    tenant's sub-queue. Elements and segments are in enqueue order, so each walk ends at
+    the first item enqueued from now on.
+*/
+bool initQueueIterator(struct QueueIterator *iterator)
+{
+    // The number of tenants is fixed while the queue exists, so the positions can be allocated unlocked.
+    size_t tenants = data_queue.options.tenants;
+    iterator->tenant_positions = NULL;
+    if (tenants > 1)
+    {
+        iterator->tenant_positions = malloc((tenants - 1) * sizeof(struct TenantPosition));
+        if (iterator->tenant_positions == NULL)
+        {
+            return false;
+        }
+    }
+    struct TenantPosition *positions = (struct TenantPosition *)iterator->tenant_positions;
+    mtx_lock(&data_queue.data_queue_lock);
+    iterator->end = data_queue.enqueued_count;
+    struct DataElement *head = data_queue.head;
+    iterator->position = head;
+    if (head != NULL)
+    {
+        head->pins++;
+    }
+    struct CompactSegment *segment = data_queue.compact_head;
+    iterator->segment = segment;
+    iterator->segment_index = 0;
+    if (segment != NULL)
+    {
+        iterator->segment_index = segment->base_index + segment->head;
+        segment->pins++;
+    }
+    iterator->tenant_count = 0;
+    for (size_t i = 1; i < tenants; i++)
+    {
+        struct DataElement *tenant_head = data_queue.tenants[i].head;
+        if (tenant_head != NULL)
+        {
+            positions[iterator->tenant_count].tenant = &data_queue.tenants[i];
+            positions[iterator->tenant_count++].element = tenant_head;
+            tenant_head->pins++;
+        }
+    }
+    mtx_unlock(&data_queue.data_queue_lock);
+    iterator->count = 0;
+    iterator->next = 0;
+    iterator->finished = false;
+    return true;
+}
+
+bool nextQueued(struct QueueIterator *iterator, void **element)
+{
+    // A batch may come back empty when everything in it was read meanwhile.
+    while (iterator->next == iterator->count)
+    {
+        if (iterator->finished)
+        {
+            return false;
+        }
+        fill_iterator(iterator);
+    }
+    *element = iterator->items[iterator->next++];
+    return true;
+}
+
+void destroyQueueIterator(struct QueueIterator *iterator)
+{
+    struct DataElement *reclaimed = NULL;
+    struct CompactSegment *reclaimed_segment = NULL;
+    mtx_lock(&data_queue.data_queue_lock);
+    unpin_iterator(iterator, &reclaimed, &reclaimed_segment);
+    mtx_unlock(&data_queue.data_queue_lock);
+    free_reclaimed(reclaimed, reclaimed_segment);
+    free(iterator->tenant_positions);
+    iterator->tenant_positions = NULL;
+    iterator->position = NULL;
+    iterator->segment = NULL;
+    iterator->tenant_count = 0;
+    iterator->finished = true;
+}
+
+/*
+    Copies the next batch of items under the lock, walking at most QUEUE_ITERATOR_BATCH
+    of them. The list, the compact segments and each tenant's sub-queue are in enqueue
+    order, so merging them by index walks the items oldest first.
+*/
+static void fill_iterator(struct QueueIterator *iterator)
+{
+    mtx_lock(&data_queue.data_queue_lock);
+    struct DataElement *reclaimed = NULL;
+    struct CompactSegment *reclaimed_segment = NULL;
+    unpin_iterator(iterator, &reclaimed, &reclaimed_segment);
+    struct DataElement *element = (struct DataElement *)iterator->position;
+    struct CompactSegment *segment = (struct CompactSegment *)iterator->segment;
+    unsigned long segment_index = iterator->segment_index;
+    struct TenantPosition *positions = (struct TenantPosition *)iterator->tenant_positions;
+    // Tenants whose walk is over are dropped, so the ones left all have an element to walk.
+    for (size_t i = 0; i < iterator->tenant_count; i++)
+    {
+        if (positions[i].element == NULL || positions[i].element->index >= iterator->end)
+        {
+            positions[i--] = positions[--iterator->tenant_count];
+        }
+    }
+    iterator->count = 0;
+    iterator->next = 0;
+    for (size_t walked = 0; walked < QUEUE_ITERATOR_BATCH; walked++)
+    {
+        unsigned long oldest = iterator->end;
+        if (element != NULL && element->index < oldest)
+        {
+            oldest = element->index;
+        }
+        if (segment != NULL && segment_index < oldest)
+        {
+            oldest = segment_index;
+        }
+        for (size_t i = 0; i < iterator->tenant_count; i++)
+        {
+            if (positions[i].element->index < oldest)
+            {
+                oldest = positions[i].element->index;
+            }
+        }
+        if (oldest == iterator->end)
+        {
+            break;
+        }
+        // A subscribed group's copy in the list shares its index with the default group's copy elsewhere, and is yielded once.
+        bool queued = false;
+        void *data = NULL;
+        if (element != NULL && element->index == oldest)
+        {
+            queued = element->readers != 0;
+            data = element->data;
+            element = element->next;
+        }
+        if (segment != NULL && segment_index == oldest)
+        {
+            queued = true;
+            data = segment->slots[segment_index++ - segment->base_index];
+            if (segment_index == segment->base_index + segment->tail)
+            {
+                segment = segment->next;
+                segment_index = segment != NULL ? segment->base_index + segment->head : 0;
+            }
+        }
+        for (size_t i = 0; i < iterator->tenant_count; i++)
+        {
+            if (positions[i].element->index == oldest)
+            {
+                queued = true;
+                data = positions[i].element->data;
+                positions[i].element = positions[i].element->next;
+                if (positions[i].element == NULL || positions[i].element->index >= iterator->end)
+                {
+                    positions[i] = positions[--iterator->tenant_count];
+                }
+                break;
+            }
+        }
+        if (queued)
+        {
+            iterator->items[iterator->count++] = data;
+        }
+    }
+    iterator->position = element != NULL && element->index < iterator->end ? element : NULL;
+    iterator->segment = segment != NULL && segment_index < iterator->end ? segment : NULL;
+    iterator->segment_index = segment_index;
+    if (iterator->position != NULL)
+    {
+        element->pins++;
+    }
+    if (iterator->segment != NULL)
+    {
+        segment->pins++;
+    }
+    for (size_t i = 0; i < iterator->tenant_count; i++)
+    {
+        positions[i].element->pins++;
+    }
+    iterator->finished = iterator->position == NULL && iterator->segment == NULL && iterator->tenant_count == 0;
+    mtx_unlock(&data_queue.data_queue_lock);
+    free_reclaimed(reclaimed, reclaimed_segment);
+}
+
+/*
+    Must be called with the lock held. Unpins every element and segment the iterator
+    holds, moving each position on to where its walk resumes, and collects those that
+    nothing holds any more into reclaimed, linked through next, and reclaimed_segment,
+    for the caller to free after unlocking. A pinned list element is still listed, and
+    its next is accurate: unlinking an element updates its neighbours, so a listed one
+    never points at a freed one. A pinned segment or tenant element may have been taken
+    meanwhile, and then that walk resumes at the head, which only holds later items.
+*/
+static void unpin_iterator(struct QueueIterator *iterator, struct DataElement **reclaimed, struct CompactSegment **reclaimed_segment)
+{
+    struct DataElement *position = (struct DataElement *)iterator->position;
+    if (position != NULL)
+    {
+        iterator->position = position->readers != 0 ? position : position->next;
+        if (unpin_element(position) != NULL)
+        {
+            position->next = *reclaimed;
+            *reclaimed = position;
+        }
+    }
+    struct CompactSegment *segment = (struct CompactSegment *)iterator->segment;
+    if (segment != NULL)
+    {
+        struct CompactSegment *resumed = segment->head < segment->tail ? segment : data_queue.compact_head;
+        iterator->segment = resumed;
+        if (resumed != NULL && iterator->segment_index < resumed->base_index + resumed->head)
+        {
+            iterator->segment_index = resumed->base_index + resumed->head;
+        }
+        *reclaimed_segment = unpin_segment(segment);
+    }
+    struct TenantPosition *positions = (struct TenantPosition *)iterator->tenant_positions;
+    for (size_t i = 0; i < iterator->tenant_count; i++)
+    {
+        struct DataElement *pinned = positions[i].element;
+        positions[i].element = pinned->readers != 0 ? pinned : positions[i].tenant->head;
+        if (unpin_tenant_element(pinned) != NULL)
+        {
+            pinned->next = *reclaimed;
+            *reclaimed = pinned;
+        }
+    }
+}
+
+static void free_reclaimed(struct DataElement *reclaimed, struct CompactSegment *reclaimed_segment)
+{
+    while (reclaimed != NULL)
+    {
+        struct DataElement *next = reclaimed->next;
+        free_node(data_queue.element_arena, reclaimed);
+        reclaimed = next;
+    }
+    free_node(data_queue.segment_arena, reclaimed_segment);
+}
+
+static bool valid_tag(int tag)
+{
+    return tag >= 0 && tag < QUEUE_MAX_TAGS;
+}
+
+bool setTenantWeight(int tenant, unsigned weight)
+{
+    if (!valid_tenant(tenant) || weight == 0)
+    {
+        return false;
+    }
+    mtx_lock(&data_queue.data_queue_lock);
+    // A tenant in the middle of its turn finishes it with the credit it was given.
+    data_queue.tenants[tenant].weight = weight;
+    mtx_unlock(&data_queue.data_queue_lock);
+    return true;
+}
+
+bool tenantStats(int tenant, struct TenantStats *stats)
+{
+    if (!valid_tenant(tenant))
+    {
+        return false;
+    }
+    mtx_lock(&data_queue.data_queue_lock);
+    struct Tenant *stats_tenant = &data_queue.tenants[tenant];
+    stats->depth = tenant_backlog(stats_tenant);
+    stats->served = stats_tenant->served_count;
+    stats->weight = stats_tenant->weight;
+    mtx_unlock(&data_queue.data_queue_lock);
+    return true;
+}
+
+static bool valid_tenant(int tenant)
+{
+    return data_queue.tenants != NULL && tenant >= 0 && (size_t)tenant < data_queue.options.tenants;
+}
+
+// Fibonacci hashing, so that keys differing only in their low bits still spread over the index.
+static size_t key_slot(uint64_t key)
+{
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (data_queue.key_index_capacity - 1);
+}
+
+// Must be called with the lock held. Returns the element pending under key, or NULL if there is none.
+static struct DataElement *find_pending(uint64_t key)
+{
+    if (data_queue.key_index_count == 0)
+    {
+        return NULL;
+    }
+    size_t mask = data_queue.key_index_capacity - 1;
+    for (size_t slot = key_slot(key); data_queue.key_index[slot] != NULL; slot = (slot + 1) & mask)
+    {
+        if (stamped_element(data_queue.key_index[slot])->key == key)
+        {
+            return data_queue.key_index[slot];
+        }
+    }
+    return NULL;
+}
+
+// Must be called with the lock held and no element pending under the element's key.
+static void index_pending(struct DataElement *element)
+{
+    // Linear probing stays short while the index is at most half full.
+    if (2 * (data_queue.key_index_count + 1) > data_queue.key_index_capacity && !grow_key_index()
+        && data_queue.key_index_count + 1 >= data_queue.key_index_capacity)
+    {
+        // Probing needs an empty slot to stop at, so without one the element takes no duplicates.
+        return;
+    }
+    size_t mask = data_queue.key_index_capacity - 1;
+    size_t slot = key_slot(stamped_element(element)->key);
+    while (data_queue.key_index[slot] != NULL)
+    {
+        slot = (slot + 1) & mask;
+    }
+    data_queue.key_index[slot] = element;
+    data_queue.key_index_count++;
+    element->keyed = true;
+}
+
+/*
+    Must be called with the lock held and an indexed element. The entries after it are
+    shifted back into the hole where that keeps them reachable from their home slot, so
+    the index needs no tombstones however many items pass through it.
+*/
+static void unindex_pending(struct DataElement *element)
+{
+    size_t mask = data_queue.key_index_capacity - 1;
+    size_t hole = key_slot(stamped_element(element)->key);
+    while (data_queue.key_index[hole] != element)
+    {
+        hole = (hole + 1) & mask;
+    }
+    for (size_t slot = (hole + 1) & mask; data_queue.key_index[slot] != NULL; slot = (slot + 1) & mask)
+    {
+        size_t home = key_slot(stamped_element(data_queue.key_index[slot])->key);
+        // The entry can move unless its home lies after the hole, up to the entry itself.
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            data_queue.key_index[hole] = data_queue.key_index[slot];
+            hole = slot;
+        }
+    }
+    data_queue.key_index[hole] = NULL;
+    data_queue.key_index_count--;
+    element->keyed = false;
+}
+
+// Returns false, leaving the index as it is, if the larger one cannot be allocated.
+static bool grow_key_index(void)
+{
+    struct DataElement **old_index = data_queue.key_index;
+    size_t old_capacity = data_queue.key_index_capacity;
+    size_t capacity = old_capacity > 0 ? 2 * old_capacity : 64;
+    struct DataElement **index = (struct DataElement **)calloc(capacity, sizeof(struct DataElement *));
+    if (index == NULL)
+    {
+        return false;
+    }
+    data_queue.key_index = index;
+    data_queue.key_index_capacity = capacity;
+    data_queue.key_index_count = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_index[i] != NULL)
+        {
+            index_pending(old_index[i]);
+        }
+    }
+    free(old_index);
+    return true;
+}
+
+// Must be called with the lock held. The elements stay queued, but no longer take duplicates.
+static void clear_key_index(void)
+{
+    for (size_t i = 0; data_queue.key_index_count > 0 && i < data_queue.key_index_capacity; i++)
+    {
+        if (data_queue.key_index[i] != NULL)
+        {
+            data_queue.key_index[i]->keyed = false;
+            data_queue.key_index[i] = NULL;
+            data_queue.key_index_count--;
+        }
+    }
+}
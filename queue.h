@@ -1,11 +1,252 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "queue_export.h"
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
-void initQueue(void);
-void destroyQueue(void);
-void enqueue(void *);
-void *dequeue(void);
-bool tryDequeue(void **);
-size_t size(void);
-size_t waiting(void);
-size_t visited(void);
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// The number of consumer groups that can be subscribed at once, besides the default one.
+#define QUEUE_MAX_GROUPS 16
+// Tags are small integers in [0, QUEUE_MAX_TAGS); plain enqueue() items carry no tag.
+#define QUEUE_MAX_TAGS 64
+#define QUEUE_NO_TAG -1
+
+QUEUE_API void initQueue(void);
+
+typedef size_t (*queue_serialize_fn)(void *element, void *buffer, size_t capacity);
+typedef void *(*queue_deserialize_fn)(const void *buffer, size_t length);
+typedef void *(*queue_merge_fn)(void *pending, void *incoming);
+
+// Optional features of the queue; a zeroed struct gives the same queue as initQueue().
+struct QueueOptions
+{
+    /*
+        Spill-to-disk tier, enabled by setting spill_directory. Once spill_threshold items
+        are queued in memory, further items are serialized into a segmented log of
+        memory-mapped files in that directory and read back by dequeue() in FIFO order.
+        destroyQueue() leaves unread spilled items there, and initQueueWithOptions() with
+        the same directory recovers them; a threshold of 0 makes every item durable this
+        way. serialize writes at most capacity bytes and returns the length it needs; it
+        and deserialize run under the queue lock. Only the default group's copy of
+        untagged items is spilled, so tagged items may overtake spilled ones. Measured
+        with benchqueue, buffered spilling runs at about the in-memory throughput, while
+        spill_durable is 50-80x slower, bound by msync latency.
+    */
+    const char *spill_directory;
+    size_t spill_threshold;
+    // The size of each segment file; 0 selects 64 MiB.
+    size_t spill_segment_size;
+    // Spilling enqueues return once their item is on disk; concurrent ones share an fsync.
+    bool spill_durable;
+    queue_serialize_fn serialize;
+    queue_deserialize_fn deserialize;
+    /*
+        Compact storage: the default group's untagged items are kept in segments of
+        QUEUE_COMPACT_SEGMENT_SLOTS pointers instead of one list node each, about 8 bytes
+        per queued item rather than 64 with malloc's overhead. A segment holds a run of
+        consecutively enqueued items, so tagged items interleaved with untagged ones cut
+        the runs short and cost compactness, though never order.
+    */
+    bool compact;
+    /*
+        The depth the queue is expected to reach, 0 if unknown. List elements, and compact
+        segments in compact mode, for that many items are then reserved up front in an
+        mmap'ed arena that is populated before initQueueWithOptions() returns and backed
+        by huge pages where the system has them, explicit ones first. Enqueues within the
+        depth thus never fault in fresh heap memory or call malloc; beyond it, or if the
+        arena cannot be mapped at all, nodes come from malloc as before.
+    */
+    size_t expected_depth;
+    /*
+        Fair mode, enabled by a nonzero number of tenants: items enqueued with enqueueFor()
+        wait for the default group in a sub-queue per tenant, and dequeue() serves the
+        tenants by deficit round-robin, taking up to a tenant's weight in items per turn,
+        so that a burst from one tenant no longer delays the others. Each dequeue is O(1)
+        however many tenants there are. Tenant 0 is everything enqueued without a tenant,
+        which keeps its order and its spilling or compact storage. Items are FIFO within
+        a tenant only, and subscribed groups still read every item in FIFO order.
+    */
+    size_t tenants;
+    /*
+        Coalescing mode: an item enqueued with enqueueKeyed() while another with the same
+        key is still pending, that is queued but not yet read by any group, is merged into
+        it instead of being appended, and the result keeps the pending item's place in
+        FIFO order. merge returns the merged item and runs under the queue lock; without
+        it the newer item replaces the pending one, which is dropped, so items that own
+        memory need a merge that frees what it discards. Keyed items are never spilled or
+        stored compactly, so like tagged items they may overtake spilled ones. Pending
+        items stop taking duplicates when a group subscribes, and an item takes none if
+        the index of pending keys cannot grow to hold it.
+    */
+    bool coalesce;
+    queue_merge_fn merge;
+    // Timestamps every item, so peek() knows the age of any but those in compact segments.
+    bool track_ages;
+};
+
+#define QUEUE_COMPACT_SEGMENT_SLOTS 128
+
+// Returns false if the options cannot be honored, e.g. the spill directory cannot be opened.
+QUEUE_API bool initQueueWithOptions(const struct QueueOptions *options);
+QUEUE_API void destroyQueue(void);
+QUEUE_API void enqueue(void *);
+QUEUE_API void *dequeue(void);
+QUEUE_API bool tryDequeue(void **);
+QUEUE_API size_t size(void);
+QUEUE_API size_t waiting(void);
+QUEUE_API size_t visited(void);
+
+/*
+    Batch dequeue: blocks like dequeue() until an item is available, then takes up to max
+    items under a single acquisition of the lock. Gives up at deadline, an absolute
+    TIME_UTC time as for cnd_timedwait, unless it is NULL. Returns the number of items
+    stored in items, which is 0 only if the deadline passed or the queue was destroyed.
+*/
+QUEUE_API size_t dequeueBatch(void **items, size_t max, const struct timespec *deadline);
+
+/*
+    Cancellable dequeue: blocks like dequeue() until an item is available or the token is
+    cancelled, storing the item and returning true, or returning false if cancelled or
+    if the queue is destroyed. Cancelling wakes only the dequeuer waiting on that token,
+    and a token cancelled before the call makes it return false at once. The fields are
+    private to the queue; a token is initialized with initCancelToken() and waited on by
+    one dequeuer at a time.
+*/
+struct CancelToken
+{
+    bool cancelled;
+    void *waiter;
+    void *thread_queue;
+};
+
+QUEUE_API void initCancelToken(struct CancelToken *token);
+QUEUE_API void cancelDequeue(struct CancelToken *token);
+QUEUE_API bool dequeueCancellable(void **element, struct CancelToken *token);
+
+/*
+    Asynchronous dequeue for consumers that must not block a thread, such as coroutines.
+    If an item is available it is stored in the out parameter and true is returned.
+    Otherwise the caller joins the waiters in the same FIFO order as blocked threads and
+    false is returned; resume(context, item, true) is then called exactly once, by the
+    thread whose enqueue serves it and after that thread released the queue lock, or
+    resume(context, NULL, false) if the queue is destroyed first.
+*/
+typedef void (*queue_resume_fn)(void *context, void *element, bool delivered);
+QUEUE_API bool dequeueAsync(void **, queue_resume_fn resume, void *context);
+
+/*
+    Fan-out: every subscribed group reads every item enqueued after it subscribed,
+    while consumers within a group compete for items like plain dequeue() callers do.
+    Plain dequeue() callers form the default group. An item is stored once and freed
+    after every group has read it.
+*/
+QUEUE_API int subscribeGroup(void);
+QUEUE_API void unsubscribeGroup(int group);
+QUEUE_API void *dequeueGroup(int group);
+QUEUE_API bool tryDequeueGroup(int group, void **);
+QUEUE_API size_t sizeGroup(int group);
+
+/*
+    Selective dequeue: dequeueMatching() takes the oldest item enqueued with the given
+    tag in O(1) and only sleeps until a matching item arrives, while plain dequeue()
+    callers still see every item in global FIFO order. Tags apply to the default group;
+    subscribed groups see tagged items like any other.
+*/
+QUEUE_API void enqueueTagged(int tag, void *);
+QUEUE_API void *dequeueMatching(int tag);
+QUEUE_API bool tryDequeueMatching(int tag, void **);
+QUEUE_API size_t sizeMatching(int tag);
+
+/*
+    Pipelines: each stage is a tag. A stage's consumer passes the item it processed on to
+    the next stage and takes its next item in a single acquisition of the lock, and the
+    list element the taken item leaves behind carries the forwarded one, with no free or
+    malloc in between. Like dequeueMatching(), it sleeps if from_tag has no item; with an
+    invalid from_tag it only forwards and returns NULL. An invalid to_tag forwards the
+    item untagged, out of the pipeline.
+*/
+QUEUE_API void *forwardMatching(int to_tag, void *element, int from_tag);
+
+// A stage's latency is the time its items spent queued, from being enqueued to being taken.
+struct StageStats
+{
+    size_t depth;
+    size_t waiting;
+    unsigned long completed;
+    double mean_latency_ns;
+    uint64_t max_latency_ns;
+};
+
+QUEUE_API bool stageStats(int tag, struct StageStats *stats);
+
+// Outside coalescing mode a plain enqueue().
+QUEUE_API void enqueueKeyed(uint64_t key, void *);
+
+// Tenants are ids in [0, tenants) of QueueOptions; other ids, or any outside fair mode, go to tenant 0.
+QUEUE_API void enqueueFor(int tenant, void *);
+// Weights start at 1. Returns false for an unknown tenant or a weight of 0.
+QUEUE_API bool setTenantWeight(int tenant, unsigned weight);
+
+// A tenant's depth counts its items the default group holds; served counts those its consumers received.
+struct TenantStats
+{
+    size_t depth;
+    unsigned long served;
+    unsigned weight;
+};
+
+QUEUE_API bool tenantStats(int tenant, struct TenantStats *stats);
+
+/*
+    Inspection without dequeuing. peek() stores the oldest queued item, the oldest that
+    some group has yet to read, and how long ago it was enqueued, if age_ns is not NULL;
+    it returns false if there is none. Only tagged and keyed items are timestamped
+    unless track_ages is set, and items in compact segments never are, so the age of any
+    other item is QUEUE_AGE_UNKNOWN. An iterator walks the queued items oldest first,
+    taking the lock once per QUEUE_ITERATOR_BATCH items rather than for the whole walk,
+    so a long scan delays enqueues and dequeues by one batch at most. Between batches it
+    pins the element it stopped at, which stays allocated until the walk moves on. The
+    walk yields, in FIFO order and at most once, every item queued when the iterator was
+    initialized that is still queued when its batch is taken, and none enqueued later.
+    Both see the default group's items in compact segments and tenant sub-queues, though
+    in fair mode each step of a batch also scans the tenants with items left to walk.
+    Items in the spill log are only on disk, and neither sees them. The fields of an
+    iterator are private to the queue, and an iterator must be destroyed before the
+    queue is.
+*/
+#define QUEUE_ITERATOR_BATCH 64
+#define QUEUE_AGE_UNKNOWN UINT64_MAX
+
+struct QueueIterator
+{
+    void *items[QUEUE_ITERATOR_BATCH];
+    size_t count;
+    size_t next;
+    void *position;
+    void *segment;
+    unsigned long segment_index;
+    void *tenant_positions;
+    size_t tenant_count;
+    unsigned long end;
+    bool finished;
+};
+
+QUEUE_API bool peek(void **element, uint64_t *age_ns);
+// Returns false if the positions in the tenant sub-queues cannot be allocated; the iterator
+// must then be neither used nor destroyed.
+QUEUE_API bool initQueueIterator(struct QueueIterator *iterator);
+QUEUE_API bool nextQueued(struct QueueIterator *iterator, void **element);
+QUEUE_API void destroyQueueIterator(struct QueueIterator *iterator);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
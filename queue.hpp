@@ -0,0 +1,182 @@
+#ifndef QUEUE_HPP
+#define QUEUE_HPP
+
+#include "queue.h"
+#include <cstring>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#define QUEUE_HAS_COROUTINES 1
+#endif
+
+/*
+    A typed front end for the C queue. The C queue is a process-wide singleton, so a
+    Queue<T> owns it: the constructor initializes it and the destructor destroys it, and
+    at most one Queue may exist at a time. Like destroyQueue(), the destructor must not
+    run while a thread is blocked in dequeue().
+
+    Values that are trivially copyable and fit in a pointer are stored inline, in the
+    data slot of the queue's own node: they are copied in and out with memcpy and need no
+    allocation of their own. Any other T is moved into a heap-allocated box.
+*/
+template <typename T>
+class Queue
+{
+public:
+    static constexpr bool stored_inline = std::is_trivially_copyable_v<T> && sizeof(T) <= sizeof(void *);
+
+    Queue() { initQueue(); }
+
+    ~Queue()
+    {
+        if constexpr (!stored_inline)
+        {
+            // destroyQueue() only frees the nodes, so the boxes still queued are ours to free.
+            void *item;
+            while (tryDequeue(&item))
+            {
+                delete static_cast<T *>(item);
+            }
+        }
+        destroyQueue();
+    }
+
+    Queue(const Queue &) = delete;
+    Queue &operator=(const Queue &) = delete;
+
+    void enqueue(T &&value) { ::enqueue(store(std::move(value))); }
+
+    void enqueue(const T &value) { ::enqueue(store(T(value))); }
+
+    template <typename... Args>
+    void emplace(Args &&...args)
+    {
+        if constexpr (stored_inline)
+        {
+            ::enqueue(store(T(std::forward<Args>(args)...)));
+        }
+        else
+        {
+            ::enqueue(new T(std::forward<Args>(args)...));
+        }
+    }
+
+    // Blocks until an item is available.
+    T dequeue() { return load(::dequeue()); }
+
+    std::optional<T> try_dequeue()
+    {
+        void *item;
+        if (!tryDequeue(&item))
+        {
+            return std::nullopt;
+        }
+        return load(item);
+    }
+
+#ifdef QUEUE_HAS_COROUTINES
+    // Resumes the coroutine inline, on the thread whose enqueue served it.
+    struct InlineScheduler
+    {
+        void operator()(std::coroutine_handle<> handle) const { handle.resume(); }
+    };
+
+    /*
+        Awaiting this suspends the coroutine without blocking its thread. The coroutine
+        waits in the same FIFO as blocked threads, and the enqueue that serves it passes
+        its handle to the scheduler, which decides where it resumes. The result is empty
+        if the queue is destroyed first.
+    */
+    template <typename Scheduler>
+    class DequeueAwaiter
+    {
+    public:
+        explicit DequeueAwaiter(Scheduler scheduler) : scheduler_(std::move(scheduler)) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            handle_ = handle;
+            // Once registered, the coroutine may be resumed elsewhere before this returns.
+            return !dequeueAsync(&item_, &DequeueAwaiter::resume, this);
+        }
+
+        std::optional<T> await_resume()
+        {
+            if (!delivered_)
+            {
+                return std::nullopt;
+            }
+            return load(item_);
+        }
+
+    private:
+        static void resume(void *context, void *element, bool delivered)
+        {
+            DequeueAwaiter *self = static_cast<DequeueAwaiter *>(context);
+            self->item_ = element;
+            self->delivered_ = delivered;
+            // The awaiter lives in the coroutine frame, which resuming may destroy.
+            Scheduler scheduler(std::move(self->scheduler_));
+            scheduler(self->handle_);
+        }
+
+        Scheduler scheduler_;
+        std::coroutine_handle<> handle_;
+        void *item_ = nullptr;
+        bool delivered_ = true;
+    };
+
+    template <typename Scheduler = InlineScheduler>
+    DequeueAwaiter<Scheduler> dequeue_async(Scheduler scheduler = Scheduler())
+    {
+        return DequeueAwaiter<Scheduler>(std::move(scheduler));
+    }
+#endif
+
+    size_t size() const { return ::size(); }
+
+    size_t waiting() const { return ::waiting(); }
+
+    size_t visited() const { return ::visited(); }
+
+private:
+    static void *store(T &&value)
+    {
+        if constexpr (stored_inline)
+        {
+            void *slot = nullptr;
+            std::memcpy(&slot, &value, sizeof(T));
+            return slot;
+        }
+        else
+        {
+            return new T(std::move(value));
+        }
+    }
+
+    static T load(void *slot)
+    {
+        if constexpr (stored_inline)
+        {
+            // T need not be default constructible, so it is copied out through raw storage.
+            alignas(T) unsigned char bytes[sizeof(T)];
+            std::memcpy(bytes, &slot, sizeof(T));
+            return *std::launder(reinterpret_cast<T *>(bytes));
+        }
+        else
+        {
+            T *box = static_cast<T *>(slot);
+            T value(std::move(*box));
+            delete box;
+            return value;
+        }
+    }
+};
+
+#endif
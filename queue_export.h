@@ -0,0 +1,14 @@
+#ifndef QUEUE_EXPORT_H
+#define QUEUE_EXPORT_H
+
+/*
+    The library is built with -fvisibility=hidden, so that the helpers its modules share
+    stay internal to it; QUEUE_API marks the functions it exports.
+*/
+#if defined(__GNUC__)
+#define QUEUE_API __attribute__((visibility("default")))
+#else
+#define QUEUE_API
+#endif
+
+#endif
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include "queue_pool.h"
+#include "queue.h"
+#include <threads.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_BATCH_SIZE 64
+#define DEFAULT_IDLE_MS 50
+
+// A worker's token, with which stopping the pool wakes it from an untimed wait.
+struct PoolWorker
+{
+    struct CancelToken token;
+    struct PoolWorker *next;
+};
+
+struct QueuePool
+{
+    queue_pool_handler handler;
+    void *context;
+    size_t min_threads;
+    size_t max_threads;
+    size_t batch_size;
+    unsigned idle_ms;
+    bool pin_threads;
+    cpu_set_t cpus;
+    mtx_t pool_lock;
+    // Signalled by the last worker to retire once the pool is stopping.
+    cnd_t stopped;
+    size_t running;
+    // Counts the workers ever started, to pin each to the next CPU in turn.
+    size_t started;
+    // size() smoothed over full batches, so that a single burst does not start a worker.
+    size_t backlog;
+    atomic_bool stopping;
+    // The running workers, each registered for as long as it runs.
+    struct PoolWorker *workers;
+};
+
+static bool start_worker(struct QueuePool *pool);
+static int pool_worker(void *arg);
+static void pin_worker(struct QueuePool *pool, size_t index);
+static void deadline_after(unsigned ms, struct timespec *deadline);
+static void grow_if_behind(struct QueuePool *pool);
+static bool retire_if_idle(struct QueuePool *pool, struct PoolWorker *worker);
+static bool waits_untimed(struct QueuePool *pool);
+static size_t wait_for_items(struct QueuePool *pool, struct PoolWorker *worker, void **items, size_t batch_size);
+
+struct QueuePool *queuePoolStart(size_t threads, queue_pool_handler handler, void *context,
+                                 const struct QueuePoolOptions *options)
+{
+    struct QueuePoolOptions defaults = {0};
+    options = options != NULL ? options : &defaults;
+    struct QueuePool *pool = (struct QueuePool *)malloc(sizeof(struct QueuePool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->handler = handler;
+    pool->context = context;
+    pool->min_threads = threads > 0 ? threads : 1;
+    pool->max_threads = options->max_threads > pool->min_threads ? options->max_threads : pool->min_threads;
+    pool->batch_size = options->batch_size > 0 ? options->batch_size : DEFAULT_BATCH_SIZE;
+    pool->idle_ms = options->idle_ms > 0 ? options->idle_ms : DEFAULT_IDLE_MS;
+    pool->pin_threads = options->pin_threads && sched_getaffinity(0, sizeof(pool->cpus), &pool->cpus) == 0;
+    mtx_init(&pool->pool_lock, mtx_plain);
+    cnd_init(&pool->stopped);
+    pool->running = 0;
+    pool->started = 0;
+    pool->backlog = 0;
+    pool->workers = NULL;
+    atomic_init(&pool->stopping, false);
+
+    mtx_lock(&pool->pool_lock);
+    while (pool->running < pool->min_threads && start_worker(pool))
+    {
+    }
+    bool started = pool->running > 0;
+    mtx_unlock(&pool->pool_lock);
+    if (!started)
+    {
+        cnd_destroy(&pool->stopped);
+        mtx_destroy(&pool->pool_lock);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void queuePoolStop(struct QueuePool *pool)
+{
+    mtx_lock(&pool->pool_lock);
+    atomic_store(&pool->stopping, true);
+    // Workers register under the pool lock, so one that registers later sees stopping and never waits untimed.
+    for (struct PoolWorker *worker = pool->workers; worker != NULL; worker = worker->next)
+    {
+        cancelDequeue(&worker->token);
+    }
+    while (pool->running > 0)
+    {
+        cnd_wait(&pool->stopped, &pool->pool_lock);
+    }
+    mtx_unlock(&pool->pool_lock);
+    cnd_destroy(&pool->stopped);
+    mtx_destroy(&pool->pool_lock);
+    free(pool);
+}
+
+size_t queuePoolThreads(struct QueuePool *pool)
+{
+    mtx_lock(&pool->pool_lock);
+    size_t running = pool->running;
+    mtx_unlock(&pool->pool_lock);
+    return running;
+}
+
+// Must be called with the pool lock held. Workers are detached; stopping waits for running to drop to 0.
+static bool start_worker(struct QueuePool *pool)
+{
+    thrd_t worker;
+    if (thrd_create(&worker, pool_worker, pool) != thrd_success)
+    {
+        return false;
+    }
+    thrd_detach(worker);
+    pool->running++;
+    return true;
+}
+
+static int pool_worker(void *arg)
+{
+    struct QueuePool *pool = (struct QueuePool *)arg;
+    struct PoolWorker worker;
+    initCancelToken(&worker.token);
+    mtx_lock(&pool->pool_lock);
+    worker.next = pool->workers;
+    pool->workers = &worker;
+    size_t index = pool->started++;
+    mtx_unlock(&pool->pool_lock);
+    if (pool->pin_threads)
+    {
+        pin_worker(pool, index);
+    }
+    // Without room for a batch, the worker takes one item at a time.
+    void *single;
+    void **batch = (void **)malloc(pool->batch_size * sizeof(void *));
+    void **items = batch != NULL ? batch : &single;
+    size_t batch_size = batch != NULL ? pool->batch_size : 1;
+    while (true)
+    {
+        if (waits_untimed(pool))
+        {
+            // Woken without items only by the pool stopping, after which it drains what is queued.
+            size_t count = wait_for_items(pool, &worker, items, batch_size);
+            if (count > 0)
+            {
+                pool->handler(pool->context, items, count);
+            }
+            continue;
+        }
+        // Once the pool is stopping, a worker only takes what is already queued.
+        struct timespec deadline;
+        deadline_after(atomic_load(&pool->stopping) ? 0 : pool->idle_ms, &deadline);
+        size_t count = dequeueBatch(items, batch_size, &deadline);
+        if (count > 0)
+        {
+            pool->handler(pool->context, items, count);
+            if (count == batch_size)
+            {
+                grow_if_behind(pool);
+            }
+        }
+        else if (retire_if_idle(pool, &worker))
+        {
+            break;
+        }
+    }
+    free(batch);
+    return 0;
+}
+
+/*
+    The workers the pool keeps, up to its minimum, have no reason to time out: they wait
+    in the queue until an item arrives, so an idle pool takes no wakeups. Only the extra
+    workers wait with a deadline, which decides when they retire.
+*/
+static bool waits_untimed(struct QueuePool *pool)
+{
+    mtx_lock(&pool->pool_lock);
+    bool untimed = !atomic_load(&pool->stopping) && pool->running <= pool->min_threads;
+    mtx_unlock(&pool->pool_lock);
+    return untimed;
+}
+
+// Blocks for one item, then takes along whatever else is already queued, up to batch_size.
+static size_t wait_for_items(struct QueuePool *pool, struct PoolWorker *worker, void **items, size_t batch_size)
+{
+    if (!dequeueCancellable(&items[0], &worker->token))
+    {
+        return 0;
+    }
+    if (batch_size == 1)
+    {
+        return 1;
+    }
+    struct timespec now;
+    deadline_after(0, &now);
+    size_t count = 1 + dequeueBatch(items + 1, batch_size - 1, &now);
+    if (count == batch_size)
+    {
+        grow_if_behind(pool);
+    }
+    return count;
+}
+
+static void pin_worker(struct QueuePool *pool, size_t index)
+{
+    int target = index % CPU_COUNT(&pool->cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &pool->cpus) && target-- == 0)
+        {
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+            return;
+        }
+    }
+}
+
+static void deadline_after(unsigned ms, struct timespec *deadline)
+{
+    timespec_get(deadline, TIME_UTC);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+    Called after a full batch. A worker is added while the smoothed backlog exceeds a
+    batch per running worker and none of them is parked waiting for items.
+*/
+static void grow_if_behind(struct QueuePool *pool)
+{
+    mtx_lock(&pool->pool_lock);
+    pool->backlog = (3 * pool->backlog + size()) / 4;
+    if (!atomic_load(&pool->stopping) && pool->running < pool->max_threads &&
+        pool->backlog > pool->batch_size * pool->running && waiting() == 0)
+    {
+        start_worker(pool);
+    }
+    mtx_unlock(&pool->pool_lock);
+}
+
+// Called after a worker waited a whole idle period in vain, or found nothing left while stopping.
+static bool retire_if_idle(struct QueuePool *pool, struct PoolWorker *worker)
+{
+    mtx_lock(&pool->pool_lock);
+    bool retire = atomic_load(&pool->stopping) || pool->running > pool->min_threads;
+    if (retire)
+    {
+        struct PoolWorker **link = &pool->workers;
+        while (*link != worker)
+        {
+            link = &(*link)->next;
+        }
+        *link = worker->next;
+        if (--pool->running == 0)
+        {
+            cnd_signal(&pool->stopped);
+        }
+    }
+    mtx_unlock(&pool->pool_lock);
+    return retire;
+}
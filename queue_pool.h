@@ -0,0 +1,57 @@
+#ifndef QUEUE_POOL_H
+#define QUEUE_POOL_H
+
+#include "queue_export.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+    A pool of worker threads draining the default group of the queue. Each worker waits
+    in dequeueBatch() and hands whatever it took, up to batch_size items, to the handler
+    in one call, so busy workers drain in batches while idle ones stay parked in the
+    queue's own FIFO of sleepers.
+*/
+typedef void (*queue_pool_handler)(void *context, void **items, size_t count);
+
+struct QueuePoolOptions
+{
+    // The pool grows up to max_threads while the backlog outpaces its workers; 0 keeps it fixed.
+    size_t max_threads;
+    // The most items passed to one handler call; 0 selects 64.
+    size_t batch_size;
+    // How long a worker waits for an item before an extra worker retires; 0 selects 50 ms.
+    unsigned idle_ms;
+    // Pins the workers round-robin to the CPUs the process may run on.
+    bool pin_threads;
+};
+
+struct QueuePool;
+
+/*
+    Starts threads workers, which never shrink below that number. options may be NULL
+    for a fixed pool with the defaults above. Returns NULL if the pool cannot be allocated
+    or no worker could be started. The queue must already be initialized and must outlive
+    the pool.
+*/
+QUEUE_API struct QueuePool *queuePoolStart(size_t threads, queue_pool_handler handler, void *context,
+                                           const struct QueuePoolOptions *options);
+/*
+    Graceful stop: the workers keep draining until they find the queue empty. Workers
+    the pool keeps wait for items without a deadline and are woken at once, so it
+    returns as soon as the last item is handled, or within one idle period of that while
+    extra workers are waiting. Items enqueued concurrently with the stop may be left in
+    the queue.
+*/
+QUEUE_API void queuePoolStop(struct QueuePool *pool);
+QUEUE_API size_t queuePoolThreads(struct QueuePool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
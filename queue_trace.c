@@ -0,0 +1,190 @@
+#define _DEFAULT_SOURCE
+#include "queue_trace.h"
+#include <time.h>
+
+// CLOCK_MONOTONIC is read through the vDSO, and unlike the TSC needs no calibration.
+uint64_t queue_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#ifdef QUEUE_TRACE
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <threads.h>
+
+_Static_assert((QUEUE_TRACE_RING_SIZE & (QUEUE_TRACE_RING_SIZE - 1)) == 0, "QUEUE_TRACE_RING_SIZE must be a power of two");
+
+struct TraceRecord
+{
+    uint64_t start;
+    uint64_t end;
+    const void *item;
+    enum QueueTraceEvent event;
+};
+
+/*
+    Only its own thread writes to a ring, publishing each record by advancing written.
+    A ring outlives its thread, so that a dump still sees what an exited thread did, and
+    is retired when the thread exits: the next dump frees it, and once
+    QUEUE_TRACE_RETIRED_RINGS are retired a new thread reuses the oldest, so threads
+    coming and going between dumps hold a bounded number of rings.
+*/
+struct TraceRing
+{
+    struct TraceRing *next;
+    unsigned thread;
+    bool retired;
+    atomic_size_t written;
+    struct TraceRecord records[QUEUE_TRACE_RING_SIZE];
+};
+
+// Guards the list of rings and every ring's thread and retired; taken once per thread and by dumps.
+static mtx_t rings_lock;
+static struct TraceRing *rings;
+static size_t retired_count;
+static unsigned ring_count;
+static once_flag rings_once = ONCE_FLAG_INIT;
+// Its destructor retires the ring of an exiting thread.
+static tss_t ring_owner;
+static bool ring_owner_created;
+static _Thread_local struct TraceRing *own_ring;
+
+static const char *const event_names[] = {
+    [QUEUE_TRACE_ENQUEUE_LOCK] = "enqueue lock",
+    [QUEUE_TRACE_DEQUEUE_LOCK] = "dequeue lock",
+    [QUEUE_TRACE_QUEUED] = "queued",
+    [QUEUE_TRACE_BLOCKED] = "blocked",
+    [QUEUE_TRACE_WAKEUP] = "wakeup",
+};
+
+static void retire_ring(void *owned)
+{
+    struct TraceRing *ring = (struct TraceRing *)owned;
+    mtx_lock(&rings_lock);
+    ring->retired = true;
+    retired_count++;
+    mtx_unlock(&rings_lock);
+}
+
+static void init_rings(void)
+{
+    mtx_init(&rings_lock, mtx_plain);
+    // Without the destructor rings are never retired, which only costs memory.
+    ring_owner_created = tss_create(&ring_owner, retire_ring) == thrd_success;
+}
+
+// Must be called with rings_lock held. The list is newest first, so the last retired ring is the oldest.
+static struct TraceRing *take_oldest_retired(void)
+{
+    struct TraceRing **oldest = NULL;
+    for (struct TraceRing **link = &rings; *link != NULL; link = &(*link)->next)
+    {
+        if ((*link)->retired)
+        {
+            oldest = link;
+        }
+    }
+    struct TraceRing *ring = *oldest;
+    *oldest = ring->next;
+    retired_count--;
+    ring->retired = false;
+    atomic_store_explicit(&ring->written, 0, memory_order_relaxed);
+    return ring;
+}
+
+// Returns NULL if no ring can be allocated, and the thread's events are then dropped.
+static struct TraceRing *create_ring(void)
+{
+    call_once(&rings_once, init_rings);
+    mtx_lock(&rings_lock);
+    struct TraceRing *ring = retired_count >= QUEUE_TRACE_RETIRED_RINGS
+                                 ? take_oldest_retired()
+                                 : (struct TraceRing *)calloc(1, sizeof(struct TraceRing));
+    if (ring != NULL)
+    {
+        ring->thread = ++ring_count;
+        ring->next = rings;
+        rings = ring;
+    }
+    mtx_unlock(&rings_lock);
+    if (ring != NULL && ring_owner_created)
+    {
+        tss_set(ring_owner, ring);
+    }
+    return ring;
+}
+
+void queue_trace_record(enum QueueTraceEvent event, uint64_t start, uint64_t end, const void *item)
+{
+    struct TraceRing *ring = own_ring;
+    if (ring == NULL)
+    {
+        ring = own_ring = create_ring();
+        if (ring == NULL)
+        {
+            return;
+        }
+    }
+    size_t written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    struct TraceRecord *record = &ring->records[written & (QUEUE_TRACE_RING_SIZE - 1)];
+    record->start = start;
+    record->end = end;
+    record->item = item;
+    record->event = event;
+    atomic_store_explicit(&ring->written, written + 1, memory_order_release);
+}
+
+bool queueTraceDump(FILE *out)
+{
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+    call_once(&rings_once, init_rings);
+    mtx_lock(&rings_lock);
+    for (struct TraceRing *ring = rings; ring != NULL; ring = ring->next)
+    {
+        size_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+        size_t oldest = written > QUEUE_TRACE_RING_SIZE ? written - QUEUE_TRACE_RING_SIZE : 0;
+        for (size_t i = oldest; i < written; i++)
+        {
+            const struct TraceRecord *record = &ring->records[i & (QUEUE_TRACE_RING_SIZE - 1)];
+            // Chrome traces count in microseconds; the fraction keeps nanosecond precision.
+            fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"queue\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                         "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"item\":\"%p\"}}",
+                    first ? "" : ",", event_names[record->event], ring->thread, record->start / 1e3,
+                    (record->end - record->start) / 1e3, record->item);
+            first = false;
+        }
+    }
+    // The events of exited threads are dumped now, so their rings are freed.
+    for (struct TraceRing **link = &rings; *link != NULL;)
+    {
+        struct TraceRing *ring = *link;
+        if (ring->retired)
+        {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+        {
+            link = &ring->next;
+        }
+    }
+    retired_count = 0;
+    mtx_unlock(&rings_lock);
+    fprintf(out, "\n]}\n");
+    return true;
+}
+
+#else
+
+bool queueTraceDump(FILE *out)
+{
+    (void)out;
+    return false;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef QUEUE_TRACE_H
+#define QUEUE_TRACE_H
+
+#include "queue_export.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+    Per-item latency tracing, compiled in only when QUEUE_TRACE is defined (make TRACE=1).
+    Each thread records into its own ring of the most recent QUEUE_TRACE_RING_SIZE events,
+    so tracing takes no lock and an old event is simply overwritten. Without QUEUE_TRACE
+    the hooks in queue.c expand to nothing; with it, every element is timestamped and
+    sleeping threads record when they were handed an item, so nodes are larger.
+*/
+enum QueueTraceEvent
+{
+    // Waiting for the queue lock in enqueue.
+    QUEUE_TRACE_ENQUEUE_LOCK,
+    // Waiting for the queue lock in a blocking dequeue.
+    QUEUE_TRACE_DEQUEUE_LOCK,
+    // From the item being stored in the queue to a consumer taking it.
+    QUEUE_TRACE_QUEUED,
+    // A dequeuer sleeping in its thread queue until an enqueue hands it an item.
+    QUEUE_TRACE_BLOCKED,
+    // From the hand-off, which signals the sleeper, to the sleeper running again.
+    QUEUE_TRACE_WAKEUP,
+};
+
+#ifndef QUEUE_TRACE_RING_SIZE
+#define QUEUE_TRACE_RING_SIZE 4096
+#endif
+
+// How many rings of exited threads are kept for the next dump before new threads reuse them.
+#ifndef QUEUE_TRACE_RETIRED_RINGS
+#define QUEUE_TRACE_RETIRED_RINGS 64
+#endif
+
+/*
+    Writes every thread's ring as Chrome trace JSON, which Perfetto and chrome://tracing
+    load directly. Returns false if tracing is compiled out. Events recorded while the
+    dump runs may be torn, so dump once the traced threads are quiescent. The rings of
+    threads that have exited are freed once dumped.
+*/
+QUEUE_API bool queueTraceDump(FILE *out);
+
+// CLOCK_MONOTONIC in nanoseconds; also used for stage latencies, so it is always compiled.
+uint64_t queue_trace_now(void);
+
+#ifdef QUEUE_TRACE
+#define QUEUE_TRACE_HOOK(...) __VA_ARGS__
+void queue_trace_record(enum QueueTraceEvent event, uint64_t start, uint64_t end, const void *item);
+#else
+#define QUEUE_TRACE_HOOK(...)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,331 @@
+#define _DEFAULT_SOURCE
+#include "relaxed_queue.h"
+#include <threads.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SUBQUEUES_PER_CPU 4
+#define EMPTY_TICKET UINT64_MAX
+// Random probes a dequeuer makes before it looks the sub-queues up in the nonempty bitmap.
+#define PROBES_BEFORE_SCAN 4
+
+struct RelaxedElement
+{
+    struct RelaxedElement *next;
+    uint64_t ticket;
+    void *data;
+};
+
+// Each sub-queue has cache lines of its own, so threads using different ones do not false-share.
+struct SubQueue
+{
+    _Alignas(64) mtx_t lock;
+    struct RelaxedElement *head;
+    struct RelaxedElement *tail;
+    // The head's ticket, read without the lock to pick the older of two sub-queues.
+    _Atomic uint64_t head_ticket;
+};
+
+struct RelaxedQueue
+{
+    struct SubQueue *subqueues;
+    size_t count;
+    /*
+        A bit per sub-queue, set while it holds items and only changed under its lock. When
+        few of many sub-queues hold items, random probes mostly find empty ones, and the
+        bitmap finds one that is not in count / 64 loads instead.
+    */
+    _Atomic uint64_t *nonempty;
+    // Drawn under the sub-queue's lock, so tickets increase from head to tail within each.
+    _Atomic uint64_t tickets;
+    // Items in the sub-queues that no dequeuer has claimed yet.
+    atomic_size_t available;
+    // Consumers park here only when nothing is available, so enqueue rarely takes this lock.
+    mtx_t park_lock;
+    cnd_t parked;
+    atomic_size_t sleepers;
+    bool terminated;
+    // Signalled by the last parked consumer to leave once the queue is destroyed.
+    cnd_t drained;
+};
+
+static struct RelaxedQueue relaxed_queue;
+static _Thread_local uint64_t random_state;
+
+static struct SubQueue *random_subqueue(void);
+static struct SubQueue *lock_any_subqueue(void);
+static struct SubQueue *any_nonempty_subqueue(void);
+static void mark_nonempty(struct SubQueue *subqueue, bool nonempty);
+static bool claim_item(void);
+static void *take_claimed_item(void);
+
+bool initRelaxedQueue(size_t subqueues)
+{
+    if (subqueues == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        subqueues = SUBQUEUES_PER_CPU * (cpus > 0 ? (size_t)cpus : 1);
+    }
+    relaxed_queue.subqueues = (struct SubQueue *)aligned_alloc(_Alignof(struct SubQueue), subqueues * sizeof(struct SubQueue));
+    relaxed_queue.count = subqueues;
+    relaxed_queue.nonempty = (_Atomic uint64_t *)calloc((subqueues + 63) / 64, sizeof(uint64_t));
+    if (relaxed_queue.subqueues == NULL || relaxed_queue.nonempty == NULL)
+    {
+        free(relaxed_queue.subqueues);
+        free(relaxed_queue.nonempty);
+        return false;
+    }
+    for (size_t i = 0; i < subqueues; i++)
+    {
+        struct SubQueue *subqueue = &relaxed_queue.subqueues[i];
+        mtx_init(&subqueue->lock, mtx_plain);
+        subqueue->head = NULL;
+        subqueue->tail = NULL;
+        atomic_init(&subqueue->head_ticket, EMPTY_TICKET);
+    }
+    atomic_init(&relaxed_queue.tickets, 0);
+    atomic_init(&relaxed_queue.available, 0);
+    atomic_init(&relaxed_queue.sleepers, 0);
+    relaxed_queue.terminated = false;
+    mtx_init(&relaxed_queue.park_lock, mtx_plain);
+    cnd_init(&relaxed_queue.parked);
+    cnd_init(&relaxed_queue.drained);
+    return true;
+}
+
+void destroyRelaxedQueue(void)
+{
+    mtx_lock(&relaxed_queue.park_lock);
+    relaxed_queue.terminated = true;
+    cnd_broadcast(&relaxed_queue.parked);
+    // A woken consumer reacquires park_lock on its way out of cnd_wait, so it is destroyed only once the last has left.
+    while (relaxed_queue.sleepers > 0)
+    {
+        cnd_wait(&relaxed_queue.drained, &relaxed_queue.park_lock);
+    }
+    mtx_unlock(&relaxed_queue.park_lock);
+    for (size_t i = 0; i < relaxed_queue.count; i++)
+    {
+        struct SubQueue *subqueue = &relaxed_queue.subqueues[i];
+        while (subqueue->head != NULL)
+        {
+            struct RelaxedElement *next = subqueue->head->next;
+            free(subqueue->head);
+            subqueue->head = next;
+        }
+        mtx_destroy(&subqueue->lock);
+    }
+    free(relaxed_queue.subqueues);
+    free(relaxed_queue.nonempty);
+    cnd_destroy(&relaxed_queue.drained);
+    cnd_destroy(&relaxed_queue.parked);
+    mtx_destroy(&relaxed_queue.park_lock);
+}
+
+void relaxedEnqueue(void *data)
+{
+    struct RelaxedElement *element = (struct RelaxedElement *)malloc(sizeof(struct RelaxedElement));
+    element->next = NULL;
+    element->data = data;
+    struct SubQueue *subqueue = lock_any_subqueue();
+    element->ticket = atomic_fetch_add_explicit(&relaxed_queue.tickets, 1, memory_order_relaxed);
+    if (subqueue->head == NULL)
+    {
+        subqueue->head = element;
+        atomic_store_explicit(&subqueue->head_ticket, element->ticket, memory_order_relaxed);
+        mark_nonempty(subqueue, true);
+    }
+    else
+    {
+        subqueue->tail->next = element;
+    }
+    subqueue->tail = element;
+    mtx_unlock(&subqueue->lock);
+    /*
+        Publishing the item and then checking for sleepers pairs with a consumer announcing
+        itself as a sleeper and then checking for items: sequentially consistent, at least
+        one of the two sees the other, so no consumer parks while the item goes unnoticed.
+    */
+    atomic_fetch_add(&relaxed_queue.available, 1);
+    if (atomic_load(&relaxed_queue.sleepers) > 0)
+    {
+        mtx_lock(&relaxed_queue.park_lock);
+        cnd_signal(&relaxed_queue.parked);
+        mtx_unlock(&relaxed_queue.park_lock);
+    }
+}
+
+void *relaxedDequeue(void)
+{
+    while (!claim_item())
+    {
+        mtx_lock(&relaxed_queue.park_lock);
+        atomic_fetch_add(&relaxed_queue.sleepers, 1);
+        while (atomic_load(&relaxed_queue.available) == 0 && !relaxed_queue.terminated)
+        {
+            cnd_wait(&relaxed_queue.parked, &relaxed_queue.park_lock);
+        }
+        bool terminated = relaxed_queue.terminated;
+        if (atomic_fetch_sub(&relaxed_queue.sleepers, 1) == 1 && terminated)
+        {
+            cnd_signal(&relaxed_queue.drained);
+        }
+        mtx_unlock(&relaxed_queue.park_lock);
+        if (terminated)
+        {
+            return NULL;
+        }
+    }
+    return take_claimed_item();
+}
+
+bool relaxedTryDequeue(void **element)
+{
+    if (!claim_item())
+    {
+        return false;
+    }
+    *element = take_claimed_item();
+    return true;
+}
+
+size_t relaxedSize(void)
+{
+    return atomic_load(&relaxed_queue.available);
+}
+
+size_t relaxedWaiting(void)
+{
+    return atomic_load(&relaxed_queue.sleepers);
+}
+
+// xorshift64*, seeded per thread so that threads probe different sub-queues.
+static struct SubQueue *random_subqueue(void)
+{
+    if (random_state == 0)
+    {
+        random_state = (uint64_t)(uintptr_t)&random_state * 0x9E3779B97F4A7C15ull | 1;
+    }
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return &relaxed_queue.subqueues[(random_state * 0x2545F4914F6CDD1Dull >> 32) % relaxed_queue.count];
+}
+
+// Producers move on from a busy sub-queue rather than wait for it, until they have tried as many as there are.
+static struct SubQueue *lock_any_subqueue(void)
+{
+    struct SubQueue *subqueue = random_subqueue();
+    for (size_t attempt = 1; attempt < relaxed_queue.count; attempt++)
+    {
+        if (mtx_trylock(&subqueue->lock) == thrd_success)
+        {
+            return subqueue;
+        }
+        subqueue = random_subqueue();
+    }
+    mtx_lock(&subqueue->lock);
+    return subqueue;
+}
+
+// A claim reserves one of the items in the sub-queues, so the claimant is sure to find one.
+static bool claim_item(void)
+{
+    size_t available = atomic_load(&relaxed_queue.available);
+    while (available > 0)
+    {
+        if (atomic_compare_exchange_weak(&relaxed_queue.available, &available, available - 1))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    The two-choice step: of two random sub-queues, take from the one whose head is older.
+    Every few attempts the nonempty bitmap picks the sub-queue instead, so that a sparse
+    queue does not cost a number of probes proportional to the sub-queues.
+*/
+static void *take_claimed_item(void)
+{
+    for (size_t attempt = 1;; attempt++)
+    {
+        struct SubQueue *older;
+        if (attempt % PROBES_BEFORE_SCAN == 0)
+        {
+            older = any_nonempty_subqueue();
+            if (older == NULL || mtx_trylock(&older->lock) != thrd_success)
+            {
+                // The claimed item is in a sub-queue someone else holds; let them finish.
+                thrd_yield();
+                continue;
+            }
+        }
+        else
+        {
+            struct SubQueue *first = random_subqueue();
+            struct SubQueue *second = random_subqueue();
+            uint64_t first_ticket = atomic_load_explicit(&first->head_ticket, memory_order_relaxed);
+            uint64_t second_ticket = atomic_load_explicit(&second->head_ticket, memory_order_relaxed);
+            older = first_ticket <= second_ticket ? first : second;
+            if ((first_ticket == EMPTY_TICKET && second_ticket == EMPTY_TICKET) ||
+                mtx_trylock(&older->lock) != thrd_success)
+            {
+                continue;
+            }
+        }
+        struct RelaxedElement *element = older->head;
+        if (element == NULL)
+        {
+            mtx_unlock(&older->lock);
+            continue;
+        }
+        older->head = element->next;
+        if (older->head == NULL)
+        {
+            older->tail = NULL;
+            mark_nonempty(older, false);
+        }
+        atomic_store_explicit(&older->head_ticket, older->head != NULL ? older->head->ticket : EMPTY_TICKET,
+                              memory_order_relaxed);
+        mtx_unlock(&older->lock);
+        void *data = element->data;
+        free(element);
+        return data;
+    }
+}
+
+// Scans the bitmap from a random word on, so that dequeuers do not all converge on the first sub-queues.
+static struct SubQueue *any_nonempty_subqueue(void)
+{
+    size_t words = (relaxed_queue.count + 63) / 64;
+    size_t start = (size_t)(random_subqueue() - relaxed_queue.subqueues) / 64;
+    for (size_t i = 0; i < words; i++)
+    {
+        size_t word = (start + i) % words;
+        uint64_t bits = atomic_load_explicit(&relaxed_queue.nonempty[word], memory_order_relaxed);
+        if (bits != 0)
+        {
+            return &relaxed_queue.subqueues[word * 64 + (size_t)__builtin_ctzll(bits)];
+        }
+    }
+    return NULL;
+}
+
+// Must be called with the sub-queue's lock held, which orders the changes to its bit.
+static void mark_nonempty(struct SubQueue *subqueue, bool nonempty)
+{
+    size_t index = (size_t)(subqueue - relaxed_queue.subqueues);
+    uint64_t bit = 1ull << (index % 64);
+    if (nonempty)
+    {
+        atomic_fetch_or_explicit(&relaxed_queue.nonempty[index / 64], bit, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_and_explicit(&relaxed_queue.nonempty[index / 64], ~bit, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef RELAXED_QUEUE_H
+#define RELAXED_QUEUE_H
+
+#include "queue_export.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+    A relaxed-order queue, for workloads that need every item processed exactly once but
+    only roughly in order. It is a MultiQueue: items are spread over several FIFO
+    sub-queues, each with its own lock, and a dequeue compares the oldest items of two
+    randomly chosen sub-queues and takes the older one. Producers and consumers thus
+    rarely contend for the same lock. After a few probes that find only empty
+    sub-queues, a dequeue looks up a nonempty one in a bitmap, so a nearly empty queue
+    costs about the same however many sub-queues it has.
+
+    The order is relaxed by a bounded amount: with k sub-queues, the item a dequeue takes
+    is among the O(k) oldest in expectation, and the O(k log k) oldest with high
+    probability. benchqueue reports the rank error it observes. With a single sub-queue
+    the order is strict FIFO. Like the queue in queue.h this is a process-wide singleton,
+    independent of it, and like enqueue(), relaxedEnqueue() assumes it can allocate the
+    item's element.
+*/
+
+// Uses the given number of sub-queues; 0 selects four per online CPU. Returns false if
+// the sub-queues cannot be allocated.
+QUEUE_API bool initRelaxedQueue(size_t subqueues);
+// Blocked relaxedDequeue() callers return NULL once the queue is destroyed.
+QUEUE_API void destroyRelaxedQueue(void);
+QUEUE_API void relaxedEnqueue(void *);
+QUEUE_API void *relaxedDequeue(void);
+QUEUE_API bool relaxedTryDequeue(void **);
+QUEUE_API size_t relaxedSize(void);
+// The number of consumers parked in relaxedDequeue() because nothing was available.
+QUEUE_API size_t relaxedWaiting(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
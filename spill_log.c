@@ -0,0 +1,544 @@
+#define _DEFAULT_SOURCE
+#include "spill_log.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SPILL_MAGIC 0x32304C4C49505351ull // "QSPILL02"
+#define SPILL_HEADER_SIZE 64
+#define SPILL_RECORD_HEADER_SIZE 8
+#define SPILL_DEFAULT_SEGMENT_SIZE (64u << 20)
+#define SPILL_PATH_MAX 4096
+// Room left in a path for the segment file name.
+#define SPILL_DIRECTORY_MAX (SPILL_PATH_MAX - 32)
+
+/*
+    Each segment file starts with a header recording how far it has been read, followed
+    by records of the form [length + 1][checksum][payload], padded to 8 bytes. A zero
+    there marks the end of the written part, since new segments are zero-filled, while
+    empty records are still stored; the checksum lets recovery discard a record that was
+    torn by a crash.
+*/
+struct SegmentHeader
+{
+    uint64_t magic;
+    uint64_t sequence;
+    uint64_t read_offset;
+};
+
+struct Segment
+{
+    struct Segment *next;
+    uint64_t sequence;
+    unsigned char *base;
+    size_t size;
+    size_t read_offset;
+    size_t end_offset;
+    size_t synced_offset;
+};
+
+struct SpillLog
+{
+    char directory[SPILL_DIRECTORY_MAX];
+    // Kept open to sync the directory entries of created and deleted segments, if durable.
+    int directory_fd;
+    bool durable;
+    bool directory_dirty;
+    size_t segment_size;
+    // Segments are kept oldest first; the reader is at the head and the writer at the tail.
+    struct Segment *head;
+    struct Segment *tail;
+    // The oldest segment that may hold records no group commit has covered yet, if any.
+    struct Segment *unsynced;
+    size_t count;
+    uint64_t appended;
+    uint64_t synced;
+    bool syncing;
+    // Segments read through while a flush was in progress; they are deleted when it ends.
+    struct Segment *retired;
+};
+
+static size_t align_record(size_t length)
+{
+    return (SPILL_RECORD_HEADER_SIZE + length + 7) & ~(size_t)7;
+}
+
+static uint32_t checksum(const unsigned char *payload, size_t length)
+{
+    // FNV-1a is plenty to tell a torn record from a complete one.
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ payload[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void segment_path(struct SpillLog *log, uint64_t sequence, char *path)
+{
+    snprintf(path, SPILL_PATH_MAX, "%s/queue-%016llx.spill", log->directory, (unsigned long long)sequence);
+}
+
+static struct Segment *map_segment(int fd, size_t size, uint64_t sequence)
+{
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive on its own.
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+    struct Segment *segment = (struct Segment *)malloc(sizeof(struct Segment));
+    if (segment == NULL)
+    {
+        munmap(base, size);
+        return NULL;
+    }
+    segment->next = NULL;
+    segment->sequence = sequence;
+    segment->base = (unsigned char *)base;
+    segment->size = size;
+    segment->read_offset = SPILL_HEADER_SIZE;
+    segment->end_offset = SPILL_HEADER_SIZE;
+    segment->synced_offset = SPILL_HEADER_SIZE;
+    return segment;
+}
+
+static void append_segment(struct SpillLog *log, struct Segment *segment)
+{
+    if (log->tail == NULL)
+    {
+        log->head = segment;
+    }
+    else
+    {
+        log->tail->next = segment;
+    }
+    log->tail = segment;
+}
+
+static void delete_segment(struct SpillLog *log, struct Segment *segment)
+{
+    char path[SPILL_PATH_MAX];
+    segment_path(log, segment->sequence, path);
+    munmap(segment->base, segment->size);
+    unlink(path);
+    free(segment);
+    log->directory_dirty = log->durable;
+}
+
+// Counts the intact records of a recovered segment, from where it was last read.
+static size_t recover_records(struct Segment *segment)
+{
+    size_t count = 0;
+    size_t offset = segment->read_offset;
+    while (offset + SPILL_RECORD_HEADER_SIZE <= segment->size)
+    {
+        uint32_t stored_length;
+        uint32_t sum;
+        memcpy(&stored_length, segment->base + offset, sizeof(stored_length));
+        memcpy(&sum, segment->base + offset + sizeof(stored_length), sizeof(sum));
+        size_t length = (size_t)stored_length - 1;
+        if (stored_length == 0 || offset + align_record(length) > segment->size ||
+            checksum(segment->base + offset + SPILL_RECORD_HEADER_SIZE, length) != sum)
+        {
+            break;
+        }
+        offset += align_record(length);
+        count++;
+    }
+    segment->end_offset = offset;
+    segment->synced_offset = offset;
+    return count;
+}
+
+static struct Segment *recover_segment(struct SpillLog *log, uint64_t sequence)
+{
+    char path[SPILL_PATH_MAX];
+    segment_path(log, sequence, path);
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < SPILL_HEADER_SIZE)
+    {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    struct Segment *segment = map_segment(fd, (size_t)size, sequence);
+    if (segment == NULL)
+    {
+        return NULL;
+    }
+    struct SegmentHeader header;
+    memcpy(&header, segment->base, sizeof(header));
+    if (header.magic != SPILL_MAGIC || header.read_offset < SPILL_HEADER_SIZE || header.read_offset > segment->size)
+    {
+        delete_segment(log, segment);
+        return NULL;
+    }
+    segment->read_offset = header.read_offset;
+    log->count += recover_records(segment);
+    return segment;
+}
+
+static int compare_sequences(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+    Recovers the segments in the order they were written and stores the next free sequence
+    number. Returns false if the segments cannot even be listed, so that none is overwritten.
+*/
+static bool recover_segments(struct SpillLog *log, DIR *directory, uint64_t *next_sequence)
+{
+    size_t num_sequences = 0;
+    size_t capacity = 16;
+    uint64_t *sequences = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    if (sequences == NULL)
+    {
+        return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        unsigned long long sequence;
+        char suffix[8];
+        if (sscanf(entry->d_name, "queue-%16llx.%7s", &sequence, suffix) != 2 || strcmp(suffix, "spill") != 0)
+        {
+            continue;
+        }
+        if (num_sequences == capacity)
+        {
+            capacity *= 2;
+            uint64_t *grown = (uint64_t *)realloc(sequences, capacity * sizeof(uint64_t));
+            if (grown == NULL)
+            {
+                free(sequences);
+                return false;
+            }
+            sequences = grown;
+        }
+        sequences[num_sequences++] = sequence;
+    }
+    qsort(sequences, num_sequences, sizeof(uint64_t), compare_sequences);
+
+    *next_sequence = 0;
+    for (size_t i = 0; i < num_sequences; i++)
+    {
+        struct Segment *segment = recover_segment(log, sequences[i]);
+        if (segment != NULL)
+        {
+            append_segment(log, segment);
+        }
+        *next_sequence = sequences[i] + 1;
+    }
+    free(sequences);
+    return true;
+}
+
+static struct Segment *create_segment(struct SpillLog *log, uint64_t sequence, size_t size)
+{
+    char path[SPILL_PATH_MAX];
+    segment_path(log, sequence, path);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)size) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    struct Segment *segment = map_segment(fd, size, sequence);
+    if (segment == NULL)
+    {
+        return NULL;
+    }
+    struct SegmentHeader header = {SPILL_MAGIC, sequence, SPILL_HEADER_SIZE};
+    memcpy(segment->base, &header, sizeof(header));
+    log->directory_dirty = log->durable;
+    return segment;
+}
+
+struct SpillLog *spill_log_open(const char *directory, size_t segment_size, bool durable)
+{
+    if (strlen(directory) >= SPILL_DIRECTORY_MAX)
+    {
+        return NULL;
+    }
+    int directory_fd = open(directory, O_RDONLY | O_DIRECTORY);
+    DIR *opened = directory_fd >= 0 ? opendir(directory) : NULL;
+    if (opened == NULL)
+    {
+        if (directory_fd >= 0)
+        {
+            close(directory_fd);
+        }
+        return NULL;
+    }
+    struct SpillLog *log = (struct SpillLog *)calloc(1, sizeof(struct SpillLog));
+    if (log == NULL)
+    {
+        closedir(opened);
+        close(directory_fd);
+        return NULL;
+    }
+    strcpy(log->directory, directory);
+    log->directory_fd = directory_fd;
+    log->durable = durable;
+    log->segment_size = segment_size > 0 ? segment_size : SPILL_DEFAULT_SEGMENT_SIZE;
+    uint64_t next_sequence;
+    bool recovered = recover_segments(log, opened, &next_sequence);
+    closedir(opened);
+    if (!recovered)
+    {
+        spill_log_close(log);
+        return NULL;
+    }
+
+    // Appending always starts on a fresh segment, so recovery never writes after a torn record.
+    struct Segment *writer = create_segment(log, next_sequence, log->segment_size);
+    if (writer == NULL)
+    {
+        spill_log_close(log);
+        return NULL;
+    }
+    append_segment(log, writer);
+    log->appended = log->count;
+    log->synced = log->count;
+    if (log->directory_dirty)
+    {
+        fsync(log->directory_fd);
+        log->directory_dirty = false;
+    }
+    return log;
+}
+
+void spill_log_close(struct SpillLog *log)
+{
+    struct Segment *segment = log->head;
+    while (segment != NULL)
+    {
+        struct Segment *next = segment->next;
+        if (segment->read_offset == segment->end_offset)
+        {
+            delete_segment(log, segment);
+        }
+        else
+        {
+            // The written part and the read offset in the header are what the next run recovers.
+            msync(segment->base, segment->end_offset, MS_SYNC);
+            munmap(segment->base, segment->size);
+            free(segment);
+        }
+        segment = next;
+    }
+    while (log->retired != NULL)
+    {
+        struct Segment *next = log->retired->next;
+        delete_segment(log, log->retired);
+        log->retired = next;
+    }
+    if (log->directory_dirty)
+    {
+        fsync(log->directory_fd);
+    }
+    close(log->directory_fd);
+    free(log);
+}
+
+size_t spill_log_count(struct SpillLog *log)
+{
+    return log->count;
+}
+
+/*
+    Moves the writer to a new segment large enough for a record of the given length. It
+    does no I/O of its own: the records of the full segment that have yet to be synced
+    are left for the next group commit, which covers every segment written since the last.
+*/
+static void roll_over(struct SpillLog *log, size_t length)
+{
+    struct Segment *full = log->tail;
+    size_t size = log->segment_size;
+    if (SPILL_HEADER_SIZE + align_record(length) > size)
+    {
+        size = SPILL_HEADER_SIZE + align_record(length);
+    }
+    struct Segment *segment = create_segment(log, full->sequence + 1, size);
+    if (segment == NULL)
+    {
+        // An enqueue has no way to fail, so a spill directory out of room or descriptors is fatal.
+        abort();
+    }
+    append_segment(log, segment);
+}
+
+uint64_t spill_log_append(struct SpillLog *log, spill_write_fn write, void *element)
+{
+    struct Segment *writer = log->tail;
+    size_t capacity = writer->size - writer->end_offset;
+    capacity = capacity > SPILL_RECORD_HEADER_SIZE ? capacity - SPILL_RECORD_HEADER_SIZE : 0;
+    unsigned char *record = writer->base + writer->end_offset;
+    size_t length = write(element, record + SPILL_RECORD_HEADER_SIZE, capacity);
+    if (length > capacity || length >= UINT32_MAX)
+    {
+        roll_over(log, length);
+        writer = log->tail;
+        record = writer->base + writer->end_offset;
+        capacity = writer->size - writer->end_offset - SPILL_RECORD_HEADER_SIZE;
+        length = write(element, record + SPILL_RECORD_HEADER_SIZE, capacity);
+    }
+    uint32_t stored_length = (uint32_t)length + 1;
+    uint32_t sum = checksum(record + SPILL_RECORD_HEADER_SIZE, length);
+    memcpy(record + sizeof(stored_length), &sum, sizeof(sum));
+    // The length goes in last, so a reader never sees a record before it is complete.
+    memcpy(record, &stored_length, sizeof(stored_length));
+    writer->end_offset += align_record(length);
+    if (log->unsynced == NULL)
+    {
+        log->unsynced = writer;
+    }
+    log->count++;
+    return ++log->appended;
+}
+
+const void *spill_log_front(struct SpillLog *log, size_t *length)
+{
+    if (log->count == 0)
+    {
+        return NULL;
+    }
+    struct Segment *reader = log->head;
+    while (reader->read_offset == reader->end_offset)
+    {
+        // Records are only ever appended to the tail, so a read-through segment is done with.
+        log->head = reader->next;
+        if (log->unsynced == reader)
+        {
+            // Its records were all read, so there is nothing left in it worth syncing.
+            log->unsynced = reader->next;
+        }
+        if (log->syncing)
+        {
+            reader->next = log->retired;
+            log->retired = reader;
+        }
+        else
+        {
+            delete_segment(log, reader);
+        }
+        reader = log->head;
+    }
+    uint32_t stored_length;
+    memcpy(&stored_length, reader->base + reader->read_offset, sizeof(stored_length));
+    *length = (size_t)stored_length - 1;
+    return reader->base + reader->read_offset + SPILL_RECORD_HEADER_SIZE;
+}
+
+void spill_log_pop(struct SpillLog *log)
+{
+    struct Segment *reader = log->head;
+    uint32_t stored_length;
+    memcpy(&stored_length, reader->base + reader->read_offset, sizeof(stored_length));
+    reader->read_offset += align_record((size_t)stored_length - 1);
+    // Persisted lazily with the segment: after a crash, records may be read again but never lost.
+    ((struct SegmentHeader *)reader->base)->read_offset = reader->read_offset;
+    log->count--;
+}
+
+bool spill_log_begin_sync(struct SpillLog *log, struct SpillSync *sync)
+{
+    if (log->syncing || log->synced == log->appended)
+    {
+        return false;
+    }
+    size_t count = 0;
+    for (struct Segment *segment = log->unsynced; segment != NULL; segment = segment->next)
+    {
+        count++;
+    }
+    sync->ranges = (struct SpillRange *)malloc(count * sizeof(struct SpillRange));
+    sync->count = 0;
+    // msync needs a page-aligned start; the pages before synced_offset are simply clean.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (struct Segment *segment = log->unsynced; segment != NULL; segment = segment->next)
+    {
+        if (segment->synced_offset == segment->end_offset)
+        {
+            continue;
+        }
+        size_t from = segment->synced_offset & ~(page - 1);
+        if (sync->ranges == NULL)
+        {
+            // Without room to note the range for the flush, it is synced now, under the caller's lock.
+            msync(segment->base + from, segment->end_offset - from, MS_SYNC);
+        }
+        else
+        {
+            sync->ranges[sync->count].address = segment->base + from;
+            sync->ranges[sync->count++].length = segment->end_offset - from;
+        }
+        segment->synced_offset = segment->end_offset;
+    }
+    log->unsynced = NULL;
+    sync->directory_fd = log->directory_dirty ? log->directory_fd : -1;
+    log->directory_dirty = false;
+    sync->sequence = log->appended;
+    log->syncing = true;
+    return true;
+}
+
+/*
+    The segments covered stay mapped until spill_log_end_sync, since a segment read
+    through meanwhile is retired rather than deleted.
+*/
+void spill_log_flush(struct SpillSync *sync)
+{
+    for (size_t i = 0; i < sync->count; i++)
+    {
+        msync(sync->ranges[i].address, sync->ranges[i].length, MS_SYNC);
+    }
+    // A new segment's records are only found after a crash if its directory entry is durable too.
+    if (sync->directory_fd >= 0)
+    {
+        fsync(sync->directory_fd);
+    }
+}
+
+void spill_log_end_sync(struct SpillLog *log, struct SpillSync *sync)
+{
+    free(sync->ranges);
+    log->syncing = false;
+    if (sync->sequence > log->synced)
+    {
+        log->synced = sync->sequence;
+    }
+    while (log->retired != NULL)
+    {
+        struct Segment *next = log->retired->next;
+        delete_segment(log, log->retired);
+        log->retired = next;
+    }
+}
+
+uint64_t spill_log_synced(struct SpillLog *log)
+{
+    return log->synced;
+}
+
+bool spill_log_syncing(struct SpillLog *log)
+{
+    return log->syncing;
+}
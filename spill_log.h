@@ -0,0 +1,66 @@
+#ifndef SPILL_LOG_H
+#define SPILL_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    A segmented, memory-mapped, append-only log of records, used by the queue to spill
+    items to disk. Records are read back in the order they were appended, and a segment
+    file is deleted once it has been read through. The log is not thread safe: the queue
+    calls it with its lock held, except for spill_log_flush.
+*/
+struct SpillLog;
+
+struct SpillRange
+{
+    void *address;
+    size_t length;
+};
+
+// Captures the part of the log a group commit makes durable.
+struct SpillSync
+{
+    // The unsynced part of every segment written since the last commit, oldest first.
+    struct SpillRange *ranges;
+    size_t count;
+    // The spill directory, if segments were created or deleted since the last commit; -1 if not.
+    int directory_fd;
+    uint64_t sequence;
+};
+
+typedef size_t (*spill_write_fn)(void *element, void *buffer, size_t capacity);
+
+/*
+    Opens the log in the given directory, recovering the unread records of any segments
+    left there by a previous run. Returns NULL if the directory cannot be used. A durable
+    log also syncs the directory, so that group commits cover the segments' entries in it.
+*/
+struct SpillLog *spill_log_open(const char *directory, size_t segment_size, bool durable);
+// Syncs and unmaps the log, leaving unread records on disk for the next spill_log_open.
+void spill_log_close(struct SpillLog *log);
+size_t spill_log_count(struct SpillLog *log);
+
+/*
+    Appends a record, letting write serialize the element in place into the mapped
+    segment. write returns the record's length; if that exceeds the capacity it was
+    given, it is called again with enough room. Returns the record's sequence number.
+*/
+uint64_t spill_log_append(struct SpillLog *log, spill_write_fn write, void *element);
+// The oldest unread record, valid until the next call on the log; NULL if there is none.
+const void *spill_log_front(struct SpillLog *log, size_t *length);
+void spill_log_pop(struct SpillLog *log);
+
+/*
+    Group commit: spill_log_begin_sync captures every record appended so far and returns
+    false if they are already durable or another sync is in progress. spill_log_flush
+    does the I/O without needing the caller's lock, and spill_log_end_sync publishes it.
+*/
+bool spill_log_begin_sync(struct SpillLog *log, struct SpillSync *sync);
+void spill_log_flush(struct SpillSync *sync);
+void spill_log_end_sync(struct SpillLog *log, struct SpillSync *sync);
+uint64_t spill_log_synced(struct SpillLog *log);
+bool spill_log_syncing(struct SpillLog *log);
+
+#endif
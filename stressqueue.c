@@ -0,0 +1,422 @@
+/*
+    Stress harness for the queue.
+
+    Producer and consumer threads record a timestamped history of every operation
+    they perform; the histories are merged after the threads are joined and checked
+    offline for FIFO linearizability. A second phase lines up sleepers one at a time
+    and checks that they are served oldest-first.
+
+    Every thread draws its scheduling delays from its own PRNG seeded from the run
+    seed, and the same delays are injected inside queue.c through QUEUE_SCHEDULE_POINT,
+    so passing a failing run's seed re-runs it with the same delay schedule. The OS
+    still schedules the threads, so a rerun is not guaranteed to fail the same way:
+
+        ./stressqueue [seed] [producers] [consumers] [items_per_producer] [rounds]
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <threads.h>
+
+static _Thread_local uint64_t rng_state;
+static void random_delay(void);
+#define QUEUE_SCHEDULE_POINT() random_delay()
+#include "queue.c"
+
+#define MAX_THREADS 64
+
+enum OperationKind
+{
+    OP_ENQUEUE,
+    OP_DEQUEUE,
+    OP_TRY_DEQUEUE
+};
+
+struct Operation
+{
+    enum OperationKind kind;
+    uintptr_t item;
+    uint64_t invoked;
+    uint64_t returned;
+};
+
+struct History
+{
+    struct Operation *operations;
+    size_t count;
+};
+
+struct Worker
+{
+    int id;
+    uint64_t seed;
+    size_t quota;
+    struct History history;
+};
+
+// Per-item summary of the merged history; item ids are 1-based.
+struct ItemRecord
+{
+    uintptr_t item;
+    size_t enqueues;
+    size_t dequeues;
+    uint64_t enqueue_invoked;
+    uint64_t enqueue_returned;
+    uint64_t dequeue_invoked;
+    uint64_t dequeue_returned;
+};
+
+static uint64_t run_seed;
+static size_t num_producers = 4;
+static size_t num_consumers = 4;
+static size_t items_per_producer = 2000;
+static size_t num_rounds = 20;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(void)
+{
+    // xorshift64*: the state of each thread is seeded from the run seed and the thread id.
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static void seed_thread(uint64_t seed)
+{
+    rng_state = seed * 0x9E3779B97F4A7C15ull + 1;
+}
+
+static void random_delay(void)
+{
+    // Threads that never seeded their PRNG (e.g. main during setup) run undisturbed.
+    if (rng_state == 0)
+    {
+        return;
+    }
+    uint64_t r = next_random();
+    switch (r % 8)
+    {
+    case 4:
+    case 5:
+        thrd_yield();
+        break;
+    case 6:
+        for (volatile uint64_t spin = (r >> 8) % 2000; spin > 0; spin--)
+        {
+        }
+        break;
+    case 7:
+        thrd_sleep(&(struct timespec){0, (long)((r >> 8) % 50000)}, NULL);
+        break;
+    default:
+        break;
+    }
+}
+
+static void record(struct History *history, enum OperationKind kind, uintptr_t item, uint64_t invoked)
+{
+    struct Operation *operation = &history->operations[history->count++];
+    operation->kind = kind;
+    operation->item = item;
+    operation->invoked = invoked;
+    operation->returned = now_ns();
+}
+
+int producer(void *arg)
+{
+    struct Worker *worker = (struct Worker *)arg;
+    seed_thread(worker->seed);
+    for (size_t i = 0; i < worker->quota; i++)
+    {
+        // Items are unique non-NULL ids, which the linearizability check relies on.
+        uintptr_t item = (uintptr_t)worker->id * worker->quota + i + 1;
+        random_delay();
+        uint64_t invoked = now_ns();
+        enqueue((void *)item);
+        record(&worker->history, OP_ENQUEUE, item, invoked);
+    }
+    return 0;
+}
+
+int consumer(void *arg)
+{
+    struct Worker *worker = (struct Worker *)arg;
+    seed_thread(worker->seed);
+    size_t taken = 0;
+    while (taken < worker->quota)
+    {
+        random_delay();
+        uint64_t invoked = now_ns();
+        void *item;
+        if (next_random() % 4 == 0)
+        {
+            // A failed tryDequeue is not recorded: it carries no ordering information we check.
+            if (!tryDequeue(&item))
+            {
+                continue;
+            }
+            record(&worker->history, OP_TRY_DEQUEUE, (uintptr_t)item, invoked);
+        }
+        else
+        {
+            item = dequeue();
+            record(&worker->history, OP_DEQUEUE, (uintptr_t)item, invoked);
+        }
+        taken++;
+    }
+    return 0;
+}
+
+static int compare_by_enqueue_returned(const void *a, const void *b)
+{
+    const struct ItemRecord *x = *(const struct ItemRecord *const *)a;
+    const struct ItemRecord *y = *(const struct ItemRecord *const *)b;
+    return (x->enqueue_returned > y->enqueue_returned) - (x->enqueue_returned < y->enqueue_returned);
+}
+
+static int compare_by_enqueue_invoked(const void *a, const void *b)
+{
+    const struct ItemRecord *x = *(const struct ItemRecord *const *)a;
+    const struct ItemRecord *y = *(const struct ItemRecord *const *)b;
+    return (x->enqueue_invoked > y->enqueue_invoked) - (x->enqueue_invoked < y->enqueue_invoked);
+}
+
+/*
+    For a queue of distinct items, a complete history is linearizable iff no item is
+    dequeued more than once, no item is dequeued without (or before) being enqueued,
+    and no two items are dequeued in an order that contradicts their enqueues: if
+    enq(a) returned before enq(b) was invoked, deq(b) must not return before deq(a)
+    is invoked. The last condition is checked in O(n log n) by sweeping the items in
+    order of enq invocation while keeping the latest deq invocation among the items
+    whose enqueue has already returned.
+*/
+static size_t check_history(struct Worker *workers, size_t num_workers, size_t num_items)
+{
+    size_t violations = 0;
+    struct ItemRecord *records = calloc(num_items + 1, sizeof(struct ItemRecord));
+    for (size_t w = 0; w < num_workers; w++)
+    {
+        struct History *history = &workers[w].history;
+        for (size_t i = 0; i < history->count; i++)
+        {
+            struct Operation *operation = &history->operations[i];
+            if (operation->item == 0 || operation->item > num_items)
+            {
+                printf("violation: dequeued unknown item %lu\n", (unsigned long)operation->item);
+                violations++;
+                continue;
+            }
+            struct ItemRecord *item = &records[operation->item];
+            item->item = operation->item;
+            if (operation->kind == OP_ENQUEUE)
+            {
+                item->enqueues++;
+                item->enqueue_invoked = operation->invoked;
+                item->enqueue_returned = operation->returned;
+            }
+            else
+            {
+                item->dequeues++;
+                item->dequeue_invoked = operation->invoked;
+                item->dequeue_returned = operation->returned;
+            }
+        }
+    }
+
+    struct ItemRecord **by_returned = malloc(num_items * sizeof(struct ItemRecord *));
+    struct ItemRecord **by_invoked = malloc(num_items * sizeof(struct ItemRecord *));
+    size_t complete = 0;
+    for (size_t i = 1; i <= num_items; i++)
+    {
+        struct ItemRecord *item = &records[i];
+        if (item->enqueues != 1 || item->dequeues != 1)
+        {
+            printf("violation: item %zu enqueued %zu times and dequeued %zu times\n", i, item->enqueues, item->dequeues);
+            violations++;
+            continue;
+        }
+        if (item->dequeue_returned < item->enqueue_invoked)
+        {
+            printf("violation: item %zu dequeued before it was enqueued\n", i);
+            violations++;
+        }
+        by_returned[complete] = item;
+        by_invoked[complete] = item;
+        complete++;
+    }
+
+    qsort(by_returned, complete, sizeof(struct ItemRecord *), compare_by_enqueue_returned);
+    qsort(by_invoked, complete, sizeof(struct ItemRecord *), compare_by_enqueue_invoked);
+    size_t preceding = 0;
+    struct ItemRecord *latest = NULL;
+    for (size_t i = 0; i < complete; i++)
+    {
+        struct ItemRecord *b = by_invoked[i];
+        while (preceding < complete && by_returned[preceding]->enqueue_returned < b->enqueue_invoked)
+        {
+            struct ItemRecord *a = by_returned[preceding++];
+            if (latest == NULL || a->dequeue_invoked > latest->dequeue_invoked)
+            {
+                latest = a;
+            }
+        }
+        if (latest != NULL && b->dequeue_returned < latest->dequeue_invoked)
+        {
+            printf("violation: item %lu enqueued before item %lu but dequeued after it\n",
+                   (unsigned long)latest->item, (unsigned long)b->item);
+            violations++;
+        }
+    }
+
+    free(by_invoked);
+    free(by_returned);
+    free(records);
+    return violations;
+}
+
+static size_t run_linearizability_phase(void)
+{
+    printf("=== Stressing concurrent enqueue and dequeue ===\n");
+
+    initQueue();
+
+    size_t num_items = num_producers * items_per_producer;
+    size_t num_workers = num_producers + num_consumers;
+    struct Worker workers[2 * MAX_THREADS];
+    thrd_t threads[2 * MAX_THREADS];
+    for (size_t w = 0; w < num_workers; w++)
+    {
+        bool is_producer = w < num_producers;
+        size_t consumer_index = w - num_producers;
+        workers[w].id = (int)(is_producer ? w : consumer_index);
+        workers[w].seed = run_seed + w + 1;
+        // Consumers split the items between them, the first ones taking the remainder.
+        workers[w].quota = is_producer ? items_per_producer
+                                       : num_items / num_consumers + (consumer_index < num_items % num_consumers);
+        workers[w].history.count = 0;
+        workers[w].history.operations = malloc(workers[w].quota * sizeof(struct Operation));
+    }
+    for (size_t w = 0; w < num_workers; w++)
+    {
+        thrd_create(&threads[w], w < num_producers ? producer : consumer, &workers[w]);
+    }
+    for (size_t w = 0; w < num_workers; w++)
+    {
+        thrd_join(threads[w], NULL);
+    }
+
+    size_t violations = check_history(workers, num_workers, num_items);
+    if (size() != 0 || waiting() != 0 || visited() != num_items)
+    {
+        printf("violation: size %zu, waiting %zu, visited %zu after quiescence\n", size(), waiting(), visited());
+        violations++;
+    }
+
+    for (size_t w = 0; w < num_workers; w++)
+    {
+        free(workers[w].history.operations);
+    }
+    destroyQueue();
+
+    printf("%zu items checked, %zu violations.\n", num_items, violations);
+    return violations;
+}
+
+struct Sleeper
+{
+    uint64_t seed;
+    uintptr_t item;
+};
+
+int sleeper(void *arg)
+{
+    struct Sleeper *self = (struct Sleeper *)arg;
+    seed_thread(self->seed);
+    self->item = (uintptr_t)dequeue();
+    return 0;
+}
+
+static size_t run_wakeup_order_phase(void)
+{
+    printf("=== Stressing oldest-sleeper-first wakeup ===\n");
+
+    size_t violations = 0;
+    for (size_t round = 0; round < num_rounds; round++)
+    {
+        initQueue();
+
+        size_t num_sleepers = num_consumers;
+        struct Sleeper sleepers[MAX_THREADS];
+        thrd_t threads[MAX_THREADS];
+        for (size_t s = 0; s < num_sleepers; s++)
+        {
+            sleepers[s].seed = run_seed ^ ((round + 1) << 32) ^ (s + 1);
+            sleepers[s].item = 0;
+            thrd_create(&threads[s], sleeper, &sleepers[s]);
+            // The next sleeper is only started once this one is parked, fixing the sleep order.
+            while (waiting() != s + 1)
+            {
+                thrd_yield();
+            }
+        }
+
+        seed_thread(run_seed ^ ((round + 1) << 32));
+        for (size_t s = 0; s < num_sleepers; s++)
+        {
+            random_delay();
+            enqueue((void *)(uintptr_t)(s + 1));
+        }
+        for (size_t s = 0; s < num_sleepers; s++)
+        {
+            thrd_join(threads[s], NULL);
+            if (sleepers[s].item != s + 1)
+            {
+                printf("violation: round %zu, sleeper %zu received item %lu\n", round, s, (unsigned long)sleepers[s].item);
+                violations++;
+            }
+        }
+        rng_state = 0;
+
+        destroyQueue();
+    }
+
+    printf("%zu rounds checked, %zu violations.\n", num_rounds, violations);
+    return violations;
+}
+
+static size_t parse_argument(int argc, char **argv, int index, size_t fallback)
+{
+    return argc > index ? strtoull(argv[index], NULL, 0) : fallback;
+}
+
+int main(int argc, char **argv)
+{
+    run_seed = argc > 1 ? strtoull(argv[1], NULL, 0) : (uint64_t)time(NULL);
+    num_producers = parse_argument(argc, argv, 2, num_producers);
+    num_consumers = parse_argument(argc, argv, 3, num_consumers);
+    items_per_producer = parse_argument(argc, argv, 4, items_per_producer);
+    num_rounds = parse_argument(argc, argv, 5, num_rounds);
+    assert(num_producers > 0 && num_producers <= MAX_THREADS);
+    assert(num_consumers > 0 && num_consumers <= MAX_THREADS);
+
+    printf("stressqueue seed %llu\n", (unsigned long long)run_seed);
+    size_t violations = run_linearizability_phase() + run_wakeup_order_phase();
+    if (violations > 0)
+    {
+        printf("FAILED with %zu violations; rerun with seed %llu for the same delay schedule.\n", violations, (unsigned long long)run_seed);
+        return 1;
+    }
+    printf("All stress checks passed!\n");
+    return 0;
+}
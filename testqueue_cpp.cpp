@@ -0,0 +1,155 @@
+#include <cassert>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "queue.hpp"
+
+struct Point
+{
+    int x;
+    int y;
+    Point(int x, int y) : x(x), y(y) {}
+};
+
+static_assert(Queue<int>::stored_inline);
+static_assert(Queue<Point>::stored_inline);
+static_assert(!Queue<std::string>::stored_inline);
+static_assert(!Queue<std::unique_ptr<int>>::stored_inline);
+
+void test_inline_values()
+{
+    printf("=== Testing inline values ===\n");
+
+    Queue<Point> queue;
+    queue.emplace(1, 2);
+    queue.enqueue(Point(3, 4));
+    // Zero is a valid value, even though it is stored as a NULL data pointer
+    queue.emplace(0, 0);
+    assert(queue.size() == 3);
+
+    Point first = queue.dequeue();
+    assert(first.x == 1 && first.y == 2);
+    std::optional<Point> second = queue.try_dequeue();
+    assert(second && second->x == 3 && second->y == 4);
+    std::optional<Point> zero = queue.try_dequeue();
+    assert(zero && zero->x == 0 && zero->y == 0);
+    assert(!queue.try_dequeue());
+
+    printf("inline values test passed.\n");
+}
+
+void test_boxed_values()
+{
+    printf("=== Testing boxed values ===\n");
+
+    {
+        Queue<std::unique_ptr<std::string>> queue;
+        queue.enqueue(std::make_unique<std::string>("hello"));
+        queue.emplace(new std::string("world"));
+        assert(*queue.dequeue() == "hello");
+        assert(*queue.try_dequeue().value() == "world");
+        // Items still queued are freed with the queue
+        queue.emplace(new std::string("leftover"));
+    }
+
+    Queue<std::string> queue;
+    std::thread consumer([&queue] { assert(queue.dequeue() == std::string(100, 'x')); });
+    while (queue.waiting() == 0)
+    {
+        std::this_thread::yield();
+    }
+    queue.emplace(100, 'x');
+    consumer.join();
+    assert(queue.visited() == 1);
+
+    printf("boxed values test passed.\n");
+}
+
+// A fire-and-forget coroutine, enough to drive dequeue_async() from the test.
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+template <typename Scheduler>
+Detached consume(Queue<int> &queue, Scheduler scheduler, std::vector<int> &received)
+{
+    std::optional<int> item = co_await queue.dequeue_async(scheduler);
+    received.push_back(item.value_or(-1));
+}
+
+// Collects resumed coroutines, to be run later as an event loop would.
+struct DeferredScheduler
+{
+    std::vector<std::coroutine_handle<>> *ready;
+    void operator()(std::coroutine_handle<> handle) const { ready->push_back(handle); }
+};
+
+void test_coroutine_dequeue()
+{
+    printf("=== Testing coroutine dequeue ===\n");
+
+    constexpr int num_coroutines = 10000;
+    std::vector<int> received;
+    {
+        Queue<int> queue;
+
+        // Many suspended coroutines wait on a single thread, and are served in FIFO order
+        for (int i = 0; i < num_coroutines; i++)
+        {
+            consume(queue, Queue<int>::InlineScheduler(), received);
+        }
+        assert(queue.waiting() == num_coroutines);
+        for (int i = 0; i < num_coroutines; i++)
+        {
+            queue.enqueue(i);
+        }
+        assert(queue.waiting() == 0);
+        for (int i = 0; i < num_coroutines; i++)
+        {
+            assert(received[i] == i);
+        }
+
+        // An item already queued is consumed without suspending
+        received.clear();
+        queue.enqueue(7);
+        consume(queue, Queue<int>::InlineScheduler(), received);
+        assert(received.size() == 1 && received[0] == 7);
+
+        // The scheduler decides where the coroutine resumes
+        std::vector<std::coroutine_handle<>> ready;
+        received.clear();
+        consume(queue, DeferredScheduler{&ready}, received);
+        queue.enqueue(8);
+        assert(received.empty() && ready.size() == 1);
+        ready[0].resume();
+        assert(received.size() == 1 && received[0] == 8);
+
+        received.clear();
+        consume(queue, Queue<int>::InlineScheduler(), received);
+    }
+    // A coroutine still waiting when the queue is destroyed gets no item
+    assert(received.size() == 1 && received[0] == -1);
+
+    printf("coroutine dequeue test passed.\n");
+}
+
+int main()
+{
+    test_inline_values();
+    test_boxed_values();
+    test_coroutine_dequeue();
+
+    printf("All C++ tests passed!\n");
+
+    return 0;
+}
@@ -0,0 +1,1407 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "queue.c"
+#include "queue_pool.h"
+#include "relaxed_queue.h"
+
+int group_consumer_thread(void *arg);
+int matching_consumer_thread(void *arg);
+int plain_consumer_thread(void *arg);
+void record_resume(void *context, void *element, bool delivered);
+int spilling_producer_thread(void *arg);
+
+void test_consumer_groups()
+{
+    printf("=== Testing consumer groups ===\n");
+
+    initQueue();
+
+    int items[] = {1, 2, 3, 4, 5};
+    size_t num_items = sizeof(items) / sizeof(items[0]);
+
+    int metrics = subscribeGroup();
+    int persister = subscribeGroup();
+    assert(metrics > 0 && persister > 0 && metrics != persister);
+
+    for (size_t i = 0; i < num_items; i++)
+    {
+        enqueue(&items[i]);
+    }
+
+    // Every group sees every item, in order, independently of the others
+    assert(size() == num_items);
+    assert(sizeGroup(metrics) == num_items);
+    for (size_t i = 0; i < num_items; i++)
+    {
+        assert(*(int *)dequeue() == items[i]);
+    }
+    void *item;
+    for (size_t i = 0; i < num_items; i++)
+    {
+        assert(tryDequeueGroup(metrics, &item));
+        assert(*(int *)item == items[i]);
+    }
+    assert(!tryDequeueGroup(metrics, &item));
+
+    // Items are kept until the last group has read them
+    assert(data_queue.head != NULL);
+    for (size_t i = 0; i < num_items; i++)
+    {
+        assert(*(int *)dequeueGroup(persister) == items[i]);
+    }
+    assert(data_queue.head == NULL);
+
+    // A group that subscribes late only sees new items, and unsubscribing releases its claim
+    enqueue(&items[0]);
+    int late = subscribeGroup();
+    enqueue(&items[1]);
+    assert(sizeGroup(late) == 1);
+    assert(sizeGroup(metrics) == 2);
+    unsubscribeGroup(late);
+    assert(*(int *)dequeue() == items[0]);
+    assert(*(int *)dequeueGroup(metrics) == items[0]);
+    assert(*(int *)dequeueGroup(persister) == items[0]);
+    assert(*(int *)dequeue() == items[1]);
+    assert(*(int *)dequeueGroup(metrics) == items[1]);
+    assert(*(int *)dequeueGroup(persister) == items[1]);
+    assert(data_queue.head == NULL);
+
+    // Sleepers of a group are handed items directly; unsubscribing wakes them with NULL
+    thrd_t sleeper;
+    int received = 0;
+    thrd_create(&sleeper, group_consumer_thread, &(int[]){persister, 0});
+    while (groups[persister].thread_queue.waiting_count == 0)
+    {
+        thrd_yield();
+    }
+    enqueue(&items[2]);
+    thrd_join(sleeper, &received);
+    assert(received == items[2]);
+    assert(*(int *)dequeue() == items[2]);
+    assert(*(int *)dequeueGroup(metrics) == items[2]);
+
+    thrd_create(&sleeper, group_consumer_thread, &(int[]){metrics, 0});
+    while (groups[metrics].thread_queue.waiting_count == 0)
+    {
+        thrd_yield();
+    }
+    unsubscribeGroup(metrics);
+    thrd_join(sleeper, &received);
+    assert(received == -1);
+    assert(dequeueGroup(metrics) == NULL);
+
+    unsubscribeGroup(persister);
+    destroyQueue();
+
+    printf("consumer groups test passed.\n");
+}
+
+int group_consumer_thread(void *arg)
+{
+    int group = *(int *)arg;
+    int *item = (int *)dequeueGroup(group);
+    return item == NULL ? -1 : *item;
+}
+
+void test_selective_dequeue()
+{
+    printf("=== Testing selective dequeue ===\n");
+
+    initQueue();
+
+    int items[] = {1, 2, 3, 4, 5};
+    enqueue(&items[0]);
+    enqueueTagged(3, &items[1]);
+    enqueueTagged(5, &items[2]);
+    enqueueTagged(3, &items[3]);
+    enqueue(&items[4]);
+
+    // Tagged consumers get the oldest matching item, plain ones the oldest remaining item
+    assert(*(int *)dequeueMatching(3) == items[1]);
+    assert(sizeMatching(3) == 1);
+    assert(size() == 4);
+    assert(*(int *)dequeue() == items[0]);
+    assert(*(int *)dequeue() == items[2]);
+    assert(sizeMatching(5) == 0);
+    void *item;
+    assert(!tryDequeueMatching(5, &item));
+    assert(tryDequeueMatching(3, &item) && *(int *)item == items[3]);
+    assert(*(int *)dequeue() == items[4]);
+    assert(size() == 0);
+    assert(data_queue.head == NULL);
+
+    // A tag sleeper is only woken by a matching item
+    thrd_t matching;
+    int received = 0;
+    thrd_create(&matching, matching_consumer_thread, &(int){7});
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    enqueue(&items[0]);
+    enqueueTagged(6, &items[1]);
+    assert(waiting() == 1);
+    enqueueTagged(7, &items[2]);
+    thrd_join(matching, &received);
+    assert(received == items[2]);
+    assert(size() == 2);
+    assert(*(int *)dequeue() == items[0]);
+    assert(*(int *)dequeue() == items[1]);
+
+    // A matching item goes to whichever eligible sleeper fell asleep first
+    thrd_t plain;
+    int plain_received = 0;
+    thrd_create(&plain, plain_consumer_thread, NULL);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    thrd_create(&matching, matching_consumer_thread, &(int){2});
+    while (waiting() != 2)
+    {
+        thrd_yield();
+    }
+    enqueueTagged(2, &items[3]);
+    thrd_join(plain, &plain_received);
+    assert(plain_received == items[3]);
+    enqueueTagged(2, &items[4]);
+    thrd_join(matching, &received);
+    assert(received == items[4]);
+
+    // Subscribed groups still read items the default group took by their tag
+    int group = subscribeGroup();
+    enqueue(&items[0]);
+    enqueueTagged(1, &items[1]);
+    assert(*(int *)dequeueMatching(1) == items[1]);
+    assert(*(int *)dequeueGroup(group) == items[0]);
+    assert(*(int *)dequeueGroup(group) == items[1]);
+    assert(*(int *)dequeue() == items[0]);
+    assert(data_queue.head == NULL);
+
+    // An item handed to a tag sleeper is stored for the subscribed group only, which the default group skips
+    enqueue(&items[0]);
+    thrd_create(&matching, matching_consumer_thread, &(int){0});
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    enqueueTagged(0, &items[1]);
+    thrd_join(matching, &received);
+    assert(received == items[1]);
+    assert(size() == 1 && sizeGroup(group) == 2);
+    assert(*(int *)dequeue() == items[0]);
+    assert(!tryDequeue(&item));
+    enqueue(&items[2]);
+    assert(*(int *)dequeue() == items[2]);
+    for (int i = 0; i < 3; i++)
+    {
+        assert(tryDequeueGroup(group, &item) && *(int *)item == items[i]);
+    }
+    assert(!tryDequeueGroup(group, &item) && data_queue.head == NULL);
+    unsubscribeGroup(group);
+
+    destroyQueue();
+
+    printf("selective dequeue test passed.\n");
+}
+
+int matching_consumer_thread(void *arg)
+{
+    int *item = (int *)dequeueMatching(*(int *)arg);
+    return item == NULL ? -1 : *item;
+}
+
+int plain_consumer_thread(void *arg)
+{
+    (void)arg;
+    int *item = (int *)dequeue();
+    return item == NULL ? -1 : *item;
+}
+
+struct ResumeLog
+{
+    int values[8];
+    int count;
+    int undelivered;
+};
+
+void test_async_dequeue()
+{
+    printf("=== Testing async dequeue ===\n");
+
+    initQueue();
+
+    int items[] = {1, 2, 3, 4};
+    struct ResumeLog log = {{0}, 0, 0};
+
+    // An available item is returned right away, without registering a waiter
+    enqueue(&items[0]);
+    void *item = NULL;
+    assert(dequeueAsync(&item, record_resume, &log));
+    assert(*(int *)item == items[0]);
+    assert(waiting() == 0);
+
+    // Asynchronous waiters share the FIFO order of blocked threads
+    assert(!dequeueAsync(&item, record_resume, &log));
+    thrd_t plain;
+    int plain_received = 0;
+    thrd_create(&plain, plain_consumer_thread, NULL);
+    while (waiting() != 2)
+    {
+        thrd_yield();
+    }
+    assert(!dequeueAsync(&item, record_resume, &log));
+    assert(waiting() == 3);
+    enqueue(&items[1]);
+    assert(log.count == 1 && log.values[0] == items[1]);
+    enqueue(&items[2]);
+    thrd_join(plain, &plain_received);
+    assert(plain_received == items[2]);
+    enqueue(&items[3]);
+    assert(log.count == 2 && log.values[1] == items[3]);
+    assert(waiting() == 0);
+
+    // Waiters still registered when the queue is destroyed are resumed as undelivered
+    assert(!dequeueAsync(&item, record_resume, &log));
+    destroyQueue();
+    assert(log.count == 2 && log.undelivered == 1);
+
+    printf("async dequeue test passed.\n");
+}
+
+void record_resume(void *context, void *element, bool delivered)
+{
+    struct ResumeLog *log = (struct ResumeLog *)context;
+    if (!delivered)
+    {
+        log->undelivered++;
+        return;
+    }
+    log->values[log->count++] = *(int *)element;
+}
+
+size_t serialize_number(void *element, void *buffer, size_t capacity)
+{
+    if (capacity >= sizeof(uintptr_t))
+    {
+        memcpy(buffer, &element, sizeof(uintptr_t));
+    }
+    return sizeof(uintptr_t);
+}
+
+void *deserialize_number(const void *buffer, size_t length)
+{
+    assert(length == sizeof(uintptr_t));
+    void *element;
+    memcpy(&element, buffer, sizeof(uintptr_t));
+    return element;
+}
+
+// Item 1 is written as an empty record, as a serializer may do for an item without payload.
+size_t serialize_sparse(void *element, void *buffer, size_t capacity)
+{
+    return (uintptr_t)element == 1 ? 0 : serialize_number(element, buffer, capacity);
+}
+
+void *deserialize_sparse(const void *buffer, size_t length)
+{
+    return length == 0 ? (void *)1 : deserialize_number(buffer, length);
+}
+
+void remove_directory(const char *path)
+{
+    DIR *directory = opendir(path);
+    struct dirent *entry;
+    char file[PATH_MAX];
+    while (directory != NULL && (entry = readdir(directory)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+        {
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            unlink(file);
+        }
+    }
+    if (directory != NULL)
+    {
+        closedir(directory);
+    }
+    rmdir(path);
+}
+
+#define SPILL_PRODUCERS 4
+#define SPILL_ITEMS_PER_PRODUCER 100
+
+void test_spill_to_disk()
+{
+    printf("=== Testing spill to disk ===\n");
+
+    char directory[] = "/tmp/testqueue-XXXXXX";
+    assert(mkdtemp(directory) != NULL);
+    struct QueueOptions options = {0};
+    options.spill_directory = directory;
+    options.spill_threshold = 2;
+    // Small segments, so that the items below span several segment files
+    options.spill_segment_size = 4096;
+    options.serialize = serialize_number;
+    options.deserialize = deserialize_number;
+    assert(initQueueWithOptions(&options));
+
+    // Items past the threshold go to disk, and come back after the in-memory ones
+    uintptr_t num_items = 1000;
+    for (uintptr_t i = 1; i <= num_items; i++)
+    {
+        enqueue((void *)i);
+    }
+    assert(size() == num_items);
+    assert(spill_log_count(data_queue.spill_log) == num_items - 2);
+    for (uintptr_t i = 1; i <= num_items / 2; i++)
+    {
+        assert((uintptr_t)dequeue() == i);
+    }
+
+    // Unread spilled items survive destroyQueue() and are recovered in order
+    destroyQueue();
+    assert(initQueueWithOptions(&options));
+    assert(size() == num_items / 2);
+    void *item;
+    for (uintptr_t i = num_items / 2 + 1; i <= num_items; i++)
+    {
+        assert(tryDequeue(&item) && (uintptr_t)item == i);
+    }
+    assert(!tryDequeue(&item));
+    destroyQueue();
+
+    // Empty records are recovered like any other, along with the records after them
+    options.spill_threshold = 0;
+    options.serialize = serialize_sparse;
+    options.deserialize = deserialize_sparse;
+    assert(initQueueWithOptions(&options));
+    uintptr_t sparse_items[] = {1, 2, 1, 1, 3};
+    size_t num_sparse = sizeof(sparse_items) / sizeof(sparse_items[0]);
+    for (size_t i = 0; i < num_sparse; i++)
+    {
+        enqueue((void *)sparse_items[i]);
+    }
+    assert((uintptr_t)dequeue() == 1);
+    destroyQueue();
+    assert(initQueueWithOptions(&options));
+    assert(size() == num_sparse - 1);
+    for (size_t i = 1; i < num_sparse; i++)
+    {
+        assert(tryDequeue(&item) && (uintptr_t)item == sparse_items[i]);
+    }
+    destroyQueue();
+    options.serialize = serialize_number;
+    options.deserialize = deserialize_number;
+
+    // The default group reads its spilled copy, skipping the subscribed group's element in memory
+    options.spill_threshold = 1;
+    assert(initQueueWithOptions(&options));
+    int group = subscribeGroup();
+    enqueue((void *)1);
+    enqueue((void *)2);
+    assert(spill_log_count(data_queue.spill_log) == 1);
+    assert((uintptr_t)dequeue() == 1 && (uintptr_t)dequeue() == 2);
+    assert(spill_log_count(data_queue.spill_log) == 0);
+    enqueue((void *)3);
+    assert((uintptr_t)dequeue() == 3);
+    for (uintptr_t i = 1; i <= 3; i++)
+    {
+        assert(tryDequeueGroup(group, &item) && (uintptr_t)item == i);
+    }
+    assert(!tryDequeueGroup(group, &item) && data_queue.head == NULL);
+    unsubscribeGroup(group);
+    destroyQueue();
+
+    // Durable producers share fsyncs, and each producer's items stay in order
+    options.spill_threshold = 0;
+    options.spill_durable = true;
+    assert(initQueueWithOptions(&options));
+    thrd_t producers[SPILL_PRODUCERS];
+    for (uintptr_t p = 0; p < SPILL_PRODUCERS; p++)
+    {
+        thrd_create(&producers[p], spilling_producer_thread, (void *)p);
+    }
+    for (int p = 0; p < SPILL_PRODUCERS; p++)
+    {
+        thrd_join(producers[p], NULL);
+    }
+    assert(spill_log_synced(data_queue.spill_log) == SPILL_PRODUCERS * SPILL_ITEMS_PER_PRODUCER);
+    uintptr_t next[SPILL_PRODUCERS] = {0};
+    for (int i = 0; i < SPILL_PRODUCERS * SPILL_ITEMS_PER_PRODUCER; i++)
+    {
+        uintptr_t value = (uintptr_t)dequeue();
+        uintptr_t producer = value / SPILL_ITEMS_PER_PRODUCER - 1;
+        assert(producer < SPILL_PRODUCERS);
+        assert(value % SPILL_ITEMS_PER_PRODUCER == next[producer]++);
+    }
+    destroyQueue();
+
+    remove_directory(directory);
+
+    printf("spill to disk test passed.\n");
+}
+
+int spilling_producer_thread(void *arg)
+{
+    uintptr_t producer = (uintptr_t)arg;
+    for (uintptr_t i = 0; i < SPILL_ITEMS_PER_PRODUCER; i++)
+    {
+        // Offset by one producer, so that no item is NULL
+        enqueue((void *)((producer + 1) * SPILL_ITEMS_PER_PRODUCER + i));
+    }
+    return 0;
+}
+
+#ifdef QUEUE_TRACE
+// Whether the dumped json, one event per line, has an event of the given name for item.
+bool has_trace_event(const char *json, const char *name, const void *item)
+{
+    char expected_name[64];
+    char expected_item[64];
+    snprintf(expected_name, sizeof(expected_name), "\"name\":\"%s\"", name);
+    snprintf(expected_item, sizeof(expected_item), "\"item\":\"%p\"", item);
+    for (const char *line = strstr(json, expected_name); line != NULL; line = strstr(line + 1, expected_name))
+    {
+        const char *end = strchr(line, '\n');
+        const char *found = strstr(line, expected_item);
+        if (found != NULL && (end == NULL || found < end))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void test_tracing()
+{
+    printf("=== Testing tracing ===\n");
+
+    initQueue();
+
+    int items[] = {1, 2};
+
+    // A sleeper is handed its item, so it records how long it blocked and took to wake
+    thrd_t consumer;
+    thrd_create(&consumer, plain_consumer_thread, NULL);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    enqueue(&items[0]);
+    thrd_join(consumer, NULL);
+
+    // A stored item records how long it sat in the queue
+    enqueue(&items[1]);
+    assert(dequeue() == &items[1]);
+    destroyQueue();
+
+    char *json;
+    size_t length;
+    FILE *out = open_memstream(&json, &length);
+    assert(queueTraceDump(out));
+    fclose(out);
+    const char *names[] = {"enqueue lock", "dequeue lock", "queued", "blocked", "wakeup"};
+    char expected[64];
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        snprintf(expected, sizeof(expected), "\"name\":\"%s\"", names[i]);
+        assert(strstr(json, expected) != NULL);
+    }
+    snprintf(expected, sizeof(expected), "\"item\":\"%p\"", (void *)&items[1]);
+    assert(strstr(json, expected) != NULL);
+    assert(strstr(json, "\"dur\":-") == NULL);
+    assert(has_trace_event(json, "blocked", &items[0]));
+    free(json);
+
+    // The consumer has exited, so the dump freed its ring, and only it blocked for items[0]
+    out = open_memstream(&json, &length);
+    assert(queueTraceDump(out));
+    fclose(out);
+    assert(!has_trace_event(json, "blocked", &items[0]));
+    assert(has_trace_event(json, "queued", &items[1]));
+    free(json);
+
+    printf("tracing test passed.\n");
+}
+#endif
+
+void test_batch_dequeue()
+{
+    printf("=== Testing batch dequeue ===\n");
+
+    initQueue();
+
+    int items[] = {1, 2, 3, 4, 5};
+    void *batch[4];
+
+    // A batch takes at most max items, in FIFO order
+    for (size_t i = 0; i < 5; i++)
+    {
+        enqueue(&items[i]);
+    }
+    assert(dequeueBatch(batch, 4, NULL) == 4);
+    for (size_t i = 0; i < 4; i++)
+    {
+        assert(batch[i] == &items[i]);
+    }
+    assert(dequeueBatch(batch, 4, NULL) == 1 && batch[0] == &items[4]);
+
+    // A timed out waiter leaves the thread queue, so later items are stored, not handed to it
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_nsec += 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    assert(dequeueBatch(batch, 4, &deadline) == 0);
+    assert(waiting() == 0);
+    enqueue(&items[0]);
+    assert(size() == 1);
+    assert(dequeue() == &items[0]);
+
+    // A sleeper timing out from the middle of the thread queue keeps the others in order
+    thrd_t first;
+    thrd_t last;
+    int first_received = 0;
+    int last_received = 0;
+    thrd_create(&first, plain_consumer_thread, NULL);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    mtx_lock(&data_queue.data_queue_lock);
+    struct ThreadElement middle;
+    init_thread_element(&middle);
+    cnd_init(&middle.cnd_thread);
+    thread_enqueue(&default_group->thread_queue, &middle);
+    mtx_unlock(&data_queue.data_queue_lock);
+    thrd_create(&last, plain_consumer_thread, NULL);
+    while (waiting() != 3)
+    {
+        thrd_yield();
+    }
+    mtx_lock(&data_queue.data_queue_lock);
+    thread_remove(&default_group->thread_queue, &middle);
+    mtx_unlock(&data_queue.data_queue_lock);
+    cnd_destroy(&middle.cnd_thread);
+    enqueue(&items[1]);
+    enqueue(&items[2]);
+    thrd_join(first, &first_received);
+    thrd_join(last, &last_received);
+    assert(first_received == items[1] && last_received == items[2]);
+
+    destroyQueue();
+
+    printf("batch dequeue test passed.\n");
+}
+
+#define POOL_ITEMS 10000
+
+struct PoolTally
+{
+    atomic_size_t handled;
+    atomic_size_t calls;
+    atomic_size_t largest_batch;
+};
+
+void tally_batch(void *context, void **items, size_t count)
+{
+    struct PoolTally *tally = (struct PoolTally *)context;
+    assert(count > 0 && count <= 16);
+    for (size_t i = 0; i < count; i++)
+    {
+        assert(items[i] != NULL);
+    }
+    size_t largest = atomic_load(&tally->largest_batch);
+    while (count > largest && !atomic_compare_exchange_weak(&tally->largest_batch, &largest, count))
+    {
+    }
+    atomic_fetch_add(&tally->calls, 1);
+    atomic_fetch_add(&tally->handled, count);
+}
+
+void test_worker_pool()
+{
+    printf("=== Testing worker pool ===\n");
+
+    initQueue();
+
+    struct PoolTally tally = {0, 0, 0};
+    struct QueuePoolOptions options = {0};
+    options.max_threads = 4;
+    options.batch_size = 16;
+    options.idle_ms = 10;
+    options.pin_threads = true;
+
+    // A backlog is handled in batches, by at most max_threads workers
+    for (uintptr_t i = 1; i <= POOL_ITEMS; i++)
+    {
+        enqueue((void *)i);
+    }
+    struct QueuePool *pool = queuePoolStart(2, tally_batch, &tally, &options);
+    assert(pool != NULL);
+    while (size() > 0)
+    {
+        assert(queuePoolThreads(pool) <= 4);
+        thrd_yield();
+    }
+    // Stopping waits for the batches still being handled
+    queuePoolStop(pool);
+    assert(tally.handled == POOL_ITEMS);
+    assert(tally.largest_batch > 1 && tally.calls < POOL_ITEMS);
+    assert(waiting() == 0);
+
+    // An idle pool shrinks back to its initial size
+    tally.handled = 0;
+    pool = queuePoolStart(1, tally_batch, &tally, &options);
+    for (uintptr_t i = 1; i <= POOL_ITEMS; i++)
+    {
+        enqueue((void *)i);
+    }
+    while (tally.handled < POOL_ITEMS)
+    {
+        thrd_yield();
+    }
+    while (queuePoolThreads(pool) > 1)
+    {
+        thrd_yield();
+    }
+    queuePoolStop(pool);
+
+    // Workers the pool keeps wait for items without a deadline, and stopping wakes them at once
+    options.idle_ms = 60000;
+    pool = queuePoolStart(2, tally_batch, &tally, &options);
+    while (waiting() < 2)
+    {
+        thrd_yield();
+    }
+    struct timespec before, after;
+    timespec_get(&before, TIME_UTC);
+    queuePoolStop(pool);
+    timespec_get(&after, TIME_UTC);
+    assert(after.tv_sec - before.tv_sec < 5 && waiting() == 0);
+
+    destroyQueue();
+
+    printf("worker pool test passed.\n");
+}
+
+#define RELAXED_THREADS 4
+#define RELAXED_ITEMS_PER_THREAD 5000
+
+static atomic_uchar relaxed_seen[RELAXED_THREADS * RELAXED_ITEMS_PER_THREAD + 1];
+
+int relaxed_producer_thread(void *arg)
+{
+    uintptr_t producer = (uintptr_t)arg;
+    for (uintptr_t i = 1; i <= RELAXED_ITEMS_PER_THREAD; i++)
+    {
+        relaxedEnqueue((void *)(producer * RELAXED_ITEMS_PER_THREAD + i));
+    }
+    return 0;
+}
+
+int relaxed_consumer_thread(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < RELAXED_ITEMS_PER_THREAD; i++)
+    {
+        atomic_fetch_add(&relaxed_seen[(uintptr_t)relaxedDequeue()], 1);
+    }
+    return 0;
+}
+
+int relaxed_blocked_thread(void *arg)
+{
+    (void)arg;
+    return relaxedDequeue() == NULL ? 0 : -1;
+}
+
+void test_relaxed_queue()
+{
+    printf("=== Testing relaxed queue ===\n");
+
+    // A single sub-queue is a strict FIFO
+    assert(initRelaxedQueue(1));
+    void *item;
+    assert(!relaxedTryDequeue(&item));
+    for (uintptr_t i = 1; i <= 100; i++)
+    {
+        relaxedEnqueue((void *)i);
+    }
+    assert(relaxedSize() == 100);
+    for (uintptr_t i = 1; i <= 100; i++)
+    {
+        assert(relaxedTryDequeue(&item) && (uintptr_t)item == i);
+    }
+    destroyRelaxedQueue();
+
+    // With several sub-queues every item is still dequeued exactly once
+    assert(initRelaxedQueue(8));
+    thrd_t producers[RELAXED_THREADS];
+    thrd_t consumers[RELAXED_THREADS];
+    for (uintptr_t t = 0; t < RELAXED_THREADS; t++)
+    {
+        thrd_create(&consumers[t], relaxed_consumer_thread, NULL);
+        thrd_create(&producers[t], relaxed_producer_thread, (void *)t);
+    }
+    for (int t = 0; t < RELAXED_THREADS; t++)
+    {
+        thrd_join(producers[t], NULL);
+        thrd_join(consumers[t], NULL);
+    }
+    for (size_t i = 1; i <= RELAXED_THREADS * RELAXED_ITEMS_PER_THREAD; i++)
+    {
+        assert(relaxed_seen[i] == 1);
+    }
+    assert(relaxedSize() == 0);
+
+    // Destroying the queue releases blocked consumers with NULL
+    thrd_t blocked;
+    int result = -1;
+    thrd_create(&blocked, relaxed_blocked_thread, NULL);
+    while (relaxedWaiting() != 1)
+    {
+        thrd_yield();
+    }
+    destroyRelaxedQueue();
+    thrd_join(blocked, &result);
+    assert(result == 0);
+
+    printf("relaxed queue test passed.\n");
+}
+
+void test_compact_storage()
+{
+    printf("=== Testing compact storage ===\n");
+
+    struct QueueOptions options = {0};
+    options.compact = true;
+    assert(initQueueWithOptions(&options));
+
+    // Untagged items fill segments instead of list elements
+    uintptr_t num_items = 3 * QUEUE_COMPACT_SEGMENT_SLOTS;
+    for (uintptr_t i = 1; i <= num_items; i++)
+    {
+        enqueue((void *)i);
+    }
+    assert(data_queue.head == NULL && size() == num_items);
+    assert(data_queue.compact_head->next->next == data_queue.compact_tail);
+    for (uintptr_t i = 1; i <= num_items; i++)
+    {
+        assert((uintptr_t)dequeue() == i);
+    }
+    assert(data_queue.compact_head == NULL && data_queue.compact_spare != NULL);
+
+    // Tagged items stay in the list, and plain dequeue still sees global FIFO order
+    enqueue((void *)1);
+    enqueueTagged(1, (void *)2);
+    enqueue((void *)3);
+    enqueueTagged(1, (void *)4);
+    enqueue((void *)5);
+    assert(data_queue.compact_head != data_queue.compact_tail);
+    for (uintptr_t i = 1; i <= 5; i++)
+    {
+        assert((uintptr_t)dequeue() == i);
+    }
+    enqueue((void *)1);
+    enqueueTagged(1, (void *)2);
+    enqueue((void *)3);
+    assert((uintptr_t)dequeueMatching(1) == 2);
+    assert((uintptr_t)dequeue() == 1 && (uintptr_t)dequeue() == 3);
+
+    // Subscribed groups read the list as usual while the default group reads the segments
+    int group = subscribeGroup();
+    for (uintptr_t i = 1; i <= 4; i++)
+    {
+        enqueue((void *)i);
+    }
+    for (uintptr_t i = 1; i <= 4; i++)
+    {
+        assert((uintptr_t)dequeueGroup(group) == i);
+        assert((uintptr_t)dequeue() == i);
+    }
+    assert(data_queue.head == NULL);
+
+    // Past a tagged item, the default group skips the group's elements for its compact copies
+    enqueueTagged(0, (void *)1);
+    enqueue((void *)2);
+    assert((uintptr_t)dequeue() == 1 && (uintptr_t)dequeue() == 2);
+    assert(size() == 0 && data_queue.compact_head == NULL);
+    void *item;
+    assert((uintptr_t)dequeueGroup(group) == 1);
+    assert(tryDequeueGroup(group, &item) && (uintptr_t)item == 2);
+    assert(!tryDequeueGroup(group, &item) && data_queue.head == NULL);
+    unsubscribeGroup(group);
+
+    destroyQueue();
+
+    printf("compact storage test passed.\n");
+}
+
+void test_node_arena()
+{
+    printf("=== Testing node arena ===\n");
+
+    struct QueueOptions options = {0};
+    options.expected_depth = 8;
+    assert(initQueueWithOptions(&options));
+    assert(data_queue.element_arena != NULL && data_queue.segment_arena == NULL);
+
+    // Items within the expected depth live in the arena, and the rest fall back to malloc
+    for (uintptr_t i = 1; i <= 12; i++)
+    {
+        enqueue((void *)i);
+        assert(arena_owns(data_queue.element_arena, data_queue.tail) == (i <= 8));
+    }
+    for (uintptr_t i = 1; i <= 12; i++)
+    {
+        assert((uintptr_t)dequeue() == i);
+    }
+
+    // Freed slots are reused, including those reclaimed by tagged and grouped consumers
+    enqueueTagged(1, (void *)1);
+    assert(arena_owns(data_queue.element_arena, data_queue.tail));
+    assert((uintptr_t)dequeueMatching(1) == 1);
+    int group = subscribeGroup();
+    for (uintptr_t i = 1; i <= 8; i++)
+    {
+        enqueue((void *)i);
+        assert(arena_owns(data_queue.element_arena, data_queue.tail));
+    }
+    unsubscribeGroup(group);
+    for (uintptr_t i = 1; i <= 8; i++)
+    {
+        assert((uintptr_t)dequeue() == i);
+    }
+    destroyQueue();
+
+    // In compact mode the segments come from an arena of their own
+    options.compact = true;
+    options.expected_depth = 2 * QUEUE_COMPACT_SEGMENT_SLOTS;
+    assert(initQueueWithOptions(&options));
+    uintptr_t num_items = 5 * QUEUE_COMPACT_SEGMENT_SLOTS;
+    for (uintptr_t i = 1; i <= num_items; i++)
+    {
+        enqueue((void *)i);
+    }
+    assert(arena_owns(data_queue.segment_arena, data_queue.compact_head));
+    assert(!arena_owns(data_queue.segment_arena, data_queue.compact_tail));
+    for (uintptr_t i = 1; i <= num_items; i++)
+    {
+        assert((uintptr_t)dequeue() == i);
+    }
+    destroyQueue();
+
+    printf("node arena test passed.\n");
+}
+
+void test_fair_tenants()
+{
+    printf("=== Testing fair tenants ===\n");
+
+    struct QueueOptions options = {0};
+    options.tenants = 1000;
+    assert(initQueueWithOptions(&options));
+
+    // A noisy tenant's burst no longer holds back the items enqueued after it
+    for (uintptr_t i = 1; i <= 100; i++)
+    {
+        enqueueFor(1, (void *)(100 + i));
+    }
+    enqueueFor(999, (void *)1);
+    enqueueFor(999, (void *)2);
+    enqueue((void *)3);
+    assert(size() == 103);
+    assert((uintptr_t)dequeue() == 101);
+    assert((uintptr_t)dequeue() == 1);
+    assert((uintptr_t)dequeue() == 3);
+    assert((uintptr_t)dequeue() == 102);
+    assert((uintptr_t)dequeue() == 2);
+    for (uintptr_t i = 3; i <= 100; i++)
+    {
+        assert((uintptr_t)dequeue() == 100 + i);
+    }
+
+    // Weights set how many items a tenant takes per turn
+    assert(setTenantWeight(2, 3) && !setTenantWeight(2, 0) && !setTenantWeight(1000, 1));
+    for (uintptr_t i = 1; i <= 6; i++)
+    {
+        enqueueFor(1, (void *)(10 + i));
+        enqueueFor(2, (void *)(20 + i));
+    }
+    uintptr_t expected[] = {11, 21, 22, 23, 12, 24, 25, 26, 13, 14, 15, 16};
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
+    {
+        assert((uintptr_t)dequeue() == expected[i]);
+    }
+
+    // Tenant 0 skips its turn once dequeueMatching took its items
+    enqueueTagged(1, (void *)1);
+    enqueueFor(5, (void *)2);
+    assert((uintptr_t)dequeueMatching(1) == 1);
+    assert((uintptr_t)dequeue() == 2);
+    void *item;
+    assert(!tryDequeue(&item));
+
+    // Subscribed groups still read every tenant's items in FIFO order
+    int group = subscribeGroup();
+    enqueueFor(1, (void *)1);
+    enqueueFor(1, (void *)2);
+    enqueueFor(2, (void *)3);
+    assert((uintptr_t)dequeue() == 1 && (uintptr_t)dequeue() == 3 && (uintptr_t)dequeue() == 2);
+    for (uintptr_t i = 1; i <= 3; i++)
+    {
+        assert((uintptr_t)dequeueGroup(group) == i);
+    }
+
+    // Past tenant 0's items, the default group skips the group's elements for tenants' items
+    enqueue((void *)1);
+    enqueueFor(3, (void *)2);
+    assert(tryDequeue(&item) && (uintptr_t)item == 1);
+    assert(tryDequeue(&item) && (uintptr_t)item == 2);
+    assert(!tryDequeue(&item));
+    enqueue((void *)3);
+    assert(tryDequeue(&item) && (uintptr_t)item == 3);
+    for (uintptr_t i = 1; i <= 3; i++)
+    {
+        assert(tryDequeueGroup(group, &item) && (uintptr_t)item == i);
+    }
+    assert(!tryDequeueGroup(group, &item) && data_queue.head == NULL);
+    unsubscribeGroup(group);
+
+    struct TenantStats stats;
+    enqueueFor(1, (void *)1);
+    assert(tenantStats(1, &stats) && stats.depth == 1 && stats.served == 108 && stats.weight == 1);
+    assert(tenantStats(2, &stats) && stats.depth == 0 && stats.served == 7 && stats.weight == 3);
+    assert(tenantStats(0, &stats) && stats.depth == 0 && stats.served == 4);
+    assert(!tenantStats(1000, &stats) && !tenantStats(-1, &stats));
+    destroyQueue();
+
+    // Outside fair mode, enqueueFor is a plain enqueue
+    initQueue();
+    enqueueFor(1, (void *)1);
+    assert((uintptr_t)dequeue() == 1 && !tenantStats(0, &stats));
+    destroyQueue();
+
+    printf("fair tenants test passed.\n");
+}
+
+static void *add_counts(void *pending, void *incoming)
+{
+    return (void *)((uintptr_t)pending + (uintptr_t)incoming);
+}
+
+void test_coalescing()
+{
+    printf("=== Testing coalescing ===\n");
+
+    struct QueueOptions options = {0};
+    options.coalesce = true;
+    assert(initQueueWithOptions(&options));
+
+    // Duplicates replace the pending item in its original place
+    enqueueKeyed(1, (void *)10);
+    enqueue((void *)2);
+    enqueueKeyed(3, (void *)30);
+    enqueueKeyed(1, (void *)11);
+    enqueueKeyed(3, (void *)31);
+    assert(size() == 3);
+    assert((uintptr_t)dequeue() == 11);
+    // Once read, a key takes new items again
+    enqueueKeyed(1, (void *)12);
+    assert((uintptr_t)dequeue() == 2 && (uintptr_t)dequeue() == 31 && (uintptr_t)dequeue() == 12);
+    assert(data_queue.key_index_count == 0);
+
+    // Items handed straight to a sleeper are not pending
+    int first = 1, second = 2;
+    thrd_t consumer;
+    thrd_create(&consumer, plain_consumer_thread, NULL);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueueKeyed(1, &first);
+    enqueueKeyed(1, &second);
+    int handed_off;
+    thrd_join(consumer, &handed_off);
+    assert(handed_off == 1 && dequeue() == &second);
+
+    // Many keys through the index, with removals from the middle of probe runs
+    uintptr_t num_keys = 1000;
+    for (int round = 0; round < 3; round++)
+    {
+        for (uintptr_t key = 0; key < num_keys; key++)
+        {
+            enqueueKeyed(key, (void *)(key + 1));
+        }
+    }
+    assert(size() == num_keys);
+    for (uintptr_t key = 0; key < num_keys; key += 2)
+    {
+        assert((uintptr_t)dequeue() == key + 1);
+        enqueueKeyed(key + 1, (void *)(key + 2));
+        assert((uintptr_t)dequeue() == key + 2);
+    }
+    for (uintptr_t key = 0; key < num_keys; key++)
+    {
+        assert(find_pending(key) == NULL);
+    }
+    destroyQueue();
+
+    // A merge function combines the items, and a new group ends the pending state
+    options.merge = add_counts;
+    assert(initQueueWithOptions(&options));
+    enqueueKeyed(7, (void *)1);
+    enqueueKeyed(7, (void *)2);
+    int group = subscribeGroup();
+    enqueueKeyed(7, (void *)4);
+    enqueueKeyed(7, (void *)8);
+    assert((uintptr_t)dequeue() == 3 && (uintptr_t)dequeue() == 12);
+    assert((uintptr_t)dequeueGroup(group) == 12);
+    enqueueKeyed(7, (void *)1);
+    assert((uintptr_t)dequeueGroup(group) == 1);
+    enqueueKeyed(7, (void *)2);
+    assert(sizeGroup(group) == 1 && size() == 2);
+    unsubscribeGroup(group);
+    assert((uintptr_t)dequeue() == 1 && (uintptr_t)dequeue() == 2);
+    destroyQueue();
+
+    printf("coalescing test passed.\n");
+}
+
+void test_peek_and_iteration()
+{
+    printf("=== Testing peek and iteration ===\n");
+
+    // Without age tracking plain items are not timestamped, and their age is unknown
+    initQueue();
+    void *item;
+    uint64_t age;
+    enqueue((void *)1);
+    usleep(1000);
+#ifndef QUEUE_TRACE
+    assert(peek(&item, &age) && (uintptr_t)item == 1 && age == QUEUE_AGE_UNKNOWN);
+#endif
+    destroyQueue();
+
+    struct QueueOptions options = {0};
+    options.track_ages = true;
+    assert(initQueueWithOptions(&options));
+    assert(!peek(&item, &age));
+    struct QueueIterator iterator;
+    assert(initQueueIterator(&iterator));
+    assert(!nextQueued(&iterator, &item));
+    destroyQueueIterator(&iterator);
+
+    uintptr_t num_items = 3 * QUEUE_ITERATOR_BATCH;
+    for (uintptr_t i = 1; i <= num_items; i++)
+    {
+        enqueue((void *)i);
+    }
+    usleep(1000);
+    assert(peek(&item, &age) && (uintptr_t)item == 1 && age >= 1000000 && size() == num_items);
+    assert(peek(&item, NULL) && (uintptr_t)item == 1);
+
+    // The lock is free between batches: items are taken and added mid-walk, and the pinned element survives
+    assert(initQueueIterator(&iterator));
+    for (uintptr_t i = 1; i <= QUEUE_ITERATOR_BATCH; i++)
+    {
+        assert(nextQueued(&iterator, &item) && (uintptr_t)item == i);
+    }
+    enqueue((void *)(num_items + 1));
+    for (uintptr_t i = 1; i <= QUEUE_ITERATOR_BATCH + 1; i++)
+    {
+        assert((uintptr_t)dequeue() == i);
+    }
+    assert(peek(&item, NULL) && (uintptr_t)item == QUEUE_ITERATOR_BATCH + 2);
+    for (uintptr_t i = QUEUE_ITERATOR_BATCH + 2; i <= num_items; i++)
+    {
+        assert(nextQueued(&iterator, &item) && (uintptr_t)item == i);
+    }
+    assert(!nextQueued(&iterator, &item));
+    assert(iterator.position == NULL);
+    destroyQueueIterator(&iterator);
+
+    // An abandoned walk releases its pin, freeing the element if it was read meanwhile
+    assert(initQueueIterator(&iterator));
+    assert(nextQueued(&iterator, &item) && (uintptr_t)item == QUEUE_ITERATOR_BATCH + 2);
+    struct DataElement *pinned = (struct DataElement *)iterator.position;
+    assert(pinned->pins == 1);
+    while (size() > 1)
+    {
+        dequeue();
+    }
+    assert(data_queue.head == pinned && pinned->readers == 0);
+    destroyQueueIterator(&iterator);
+    assert(data_queue.head->next == NULL && (uintptr_t)data_queue.head->data == num_items + 1);
+
+    // Items some subscribed group has yet to read are still queued
+    int group = subscribeGroup();
+    enqueue((void *)1);
+    assert((uintptr_t)dequeue() == num_items + 1 && (uintptr_t)dequeue() == 1);
+    assert(peek(&item, NULL) && (uintptr_t)item == 1);
+    assert(initQueueIterator(&iterator));
+    assert(nextQueued(&iterator, &item) && (uintptr_t)item == 1 && !nextQueued(&iterator, &item));
+    destroyQueueIterator(&iterator);
+    unsubscribeGroup(group);
+    assert(!peek(&item, NULL));
+    destroyQueue();
+
+    // Compact segments are merged with the list in enqueue order, past a segment emptied mid-walk
+    options = (struct QueueOptions){0};
+    options.compact = true;
+    assert(initQueueWithOptions(&options));
+    num_items = 2 * QUEUE_COMPACT_SEGMENT_SLOTS;
+    for (uintptr_t i = 1; i <= num_items; i++)
+    {
+        i == 2 ? enqueueTagged(0, (void *)i) : enqueue((void *)i);
+    }
+    assert(peek(&item, &age) && (uintptr_t)item == 1 && age == QUEUE_AGE_UNKNOWN && size() == num_items);
+    assert(initQueueIterator(&iterator));
+    for (uintptr_t i = 1; i <= QUEUE_ITERATOR_BATCH; i++)
+    {
+        assert(nextQueued(&iterator, &item) && (uintptr_t)item == i);
+    }
+    for (uintptr_t i = 1; i <= QUEUE_COMPACT_SEGMENT_SLOTS + 1; i++)
+    {
+        assert((uintptr_t)dequeue() == i);
+    }
+    assert(peek(&item, NULL) && (uintptr_t)item == QUEUE_COMPACT_SEGMENT_SLOTS + 2);
+    for (uintptr_t i = QUEUE_COMPACT_SEGMENT_SLOTS + 2; i <= num_items; i++)
+    {
+        assert(nextQueued(&iterator, &item) && (uintptr_t)item == i);
+    }
+    assert(!nextQueued(&iterator, &item));
+    destroyQueueIterator(&iterator);
+
+    // A subscribed group's copy in the list is yielded once, not besides the default group's slot
+    group = subscribeGroup();
+    enqueue((void *)(num_items + 1));
+    assert(initQueueIterator(&iterator));
+    for (uintptr_t i = QUEUE_COMPACT_SEGMENT_SLOTS + 2; i <= num_items + 1; i++)
+    {
+        assert(nextQueued(&iterator, &item) && (uintptr_t)item == i);
+    }
+    assert(!nextQueued(&iterator, &item));
+    destroyQueueIterator(&iterator);
+    destroyQueue();
+
+    // Tenants' sub-queues are merged in enqueue order too, and a taken pinned element ends its walk
+    options = (struct QueueOptions){0};
+    options.tenants = 3;
+    assert(initQueueWithOptions(&options));
+    enqueueFor(2, (void *)1);
+    assert(size() == 1 && peek(&item, NULL) && (uintptr_t)item == 1);
+    enqueue((void *)2);
+    for (uintptr_t i = 3; i <= num_items; i++)
+    {
+        enqueueFor(1, (void *)i);
+    }
+    group = subscribeGroup();
+    enqueueFor(2, (void *)(num_items + 1));
+    assert(initQueueIterator(&iterator));
+    for (uintptr_t i = 1; i <= QUEUE_ITERATOR_BATCH; i++)
+    {
+        assert(nextQueued(&iterator, &item) && (uintptr_t)item == i);
+    }
+    while (size() > 0)
+    {
+        dequeue();
+    }
+    assert(peek(&item, NULL) && (uintptr_t)item == num_items + 1);
+    assert(nextQueued(&iterator, &item) && (uintptr_t)item == num_items + 1 && !nextQueued(&iterator, &item));
+    destroyQueueIterator(&iterator);
+    assert((uintptr_t)dequeueGroup(group) == num_items + 1 && !peek(&item, NULL));
+    destroyQueue();
+
+    printf("peek and iteration test passed.\n");
+}
+
+struct CancellableConsumer
+{
+    struct CancelToken token;
+    bool delivered;
+    void *item;
+};
+
+int cancellable_consumer_thread(void *arg)
+{
+    struct CancellableConsumer *consumer = (struct CancellableConsumer *)arg;
+    consumer->delivered = dequeueCancellable(&consumer->item, &consumer->token);
+    return 0;
+}
+
+void test_cancellable_dequeue()
+{
+    printf("=== Testing cancellable dequeue ===\n");
+
+    initQueue();
+
+    int items[] = {1, 2, 3};
+
+    // A token cancelled beforehand makes the call return at once, even with items queued
+    struct CancellableConsumer early;
+    initCancelToken(&early.token);
+    cancelDequeue(&early.token);
+    enqueue(&items[0]);
+    assert(!dequeueCancellable(&early.item, &early.token));
+    initCancelToken(&early.token);
+    assert(dequeueCancellable(&early.item, &early.token) && early.item == &items[0]);
+
+    // Cancelling a sleeper in the middle wakes only it, and the others keep their order
+    thrd_t first;
+    thrd_t middle;
+    thrd_t last;
+    int first_received = 0;
+    int last_received = 0;
+    struct CancellableConsumer cancelled;
+    initCancelToken(&cancelled.token);
+    thrd_create(&first, plain_consumer_thread, NULL);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    thrd_create(&middle, cancellable_consumer_thread, &cancelled);
+    while (waiting() != 2)
+    {
+        thrd_yield();
+    }
+    thrd_create(&last, plain_consumer_thread, NULL);
+    while (waiting() != 3)
+    {
+        thrd_yield();
+    }
+    cancelDequeue(&cancelled.token);
+    thrd_join(middle, NULL);
+    assert(!cancelled.delivered && cancelled.item == NULL);
+    assert(waiting() == 2);
+    enqueue(&items[1]);
+    enqueue(&items[2]);
+    thrd_join(first, &first_received);
+    thrd_join(last, &last_received);
+    assert(first_received == items[1] && last_received == items[2]);
+
+    // Cancelling after the item was handed over changes nothing
+    struct CancellableConsumer served;
+    initCancelToken(&served.token);
+    thrd_create(&middle, cancellable_consumer_thread, &served);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    enqueue(&items[0]);
+    cancelDequeue(&served.token);
+    thrd_join(middle, NULL);
+    assert(served.delivered && served.item == &items[0]);
+    assert(waiting() == 0 && size() == 0);
+
+    destroyQueue();
+
+    printf("cancellable dequeue test passed.\n");
+}
+
+#define PIPELINE_ITEMS 1000
+
+struct PipelineStage
+{
+    int from;
+    int to;
+};
+
+// Adds the stage's number to each item, and passes it on.
+int pipeline_stage_thread(void *arg)
+{
+    struct PipelineStage *stage = (struct PipelineStage *)arg;
+    uintptr_t item = (uintptr_t)dequeueMatching(stage->from);
+    for (int i = 1; i <= PIPELINE_ITEMS; i++)
+    {
+        int from = i < PIPELINE_ITEMS ? stage->from : QUEUE_NO_TAG;
+        item = (uintptr_t)forwardMatching(stage->to, (void *)(item + stage->to), from);
+    }
+    return 0;
+}
+
+void test_pipeline()
+{
+    printf("=== Testing pipeline stages ===\n");
+
+    initQueue();
+
+    // Forwarding moves the element of the item taken onto the next stage
+    enqueueTagged(0, (void *)1);
+    enqueueTagged(0, (void *)2);
+    struct DataElement *second = tags[0].tail;
+    assert((uintptr_t)dequeueMatching(0) == 1);
+    assert((uintptr_t)forwardMatching(1, (void *)10, 0) == 2);
+    assert(tags[1].head == second && second->data == (void *)10 && second->tag == 1);
+    assert(forwardMatching(1, (void *)20, QUEUE_NO_TAG) == NULL);
+    assert((uintptr_t)dequeueMatching(1) == 10 && (uintptr_t)dequeueMatching(1) == 20);
+
+    // Stages 0 -> 1 -> 2 run concurrently, each adding its number, and keep FIFO order
+    struct PipelineStage stages[] = {{0, 1}, {1, 2}};
+    thrd_t threads[2];
+    for (int i = 0; i < 2; i++)
+    {
+        thrd_create(&threads[i], pipeline_stage_thread, &stages[i]);
+    }
+    for (uintptr_t i = 1; i <= PIPELINE_ITEMS; i++)
+    {
+        enqueueTagged(0, (void *)(i * 8));
+    }
+    for (uintptr_t i = 1; i <= PIPELINE_ITEMS; i++)
+    {
+        assert((uintptr_t)dequeueMatching(2) == i * 8 + 3);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+
+    // Every item left each stage once, and stage 0 also served the two items above
+    struct StageStats stats;
+    assert(stageStats(0, &stats));
+    assert(stats.depth == 0 && stats.waiting == 0 && stats.completed == PIPELINE_ITEMS + 2);
+    assert(stats.max_latency_ns >= stats.mean_latency_ns);
+    assert(stageStats(2, &stats) && stats.completed == PIPELINE_ITEMS);
+    assert(!stageStats(QUEUE_MAX_TAGS, &stats));
+    assert(size() == 0);
+
+    destroyQueue();
+
+    printf("pipeline stages test passed.\n");
+}
+
+int main()
+{
+    test_consumer_groups();
+    test_selective_dequeue();
+    test_async_dequeue();
+    test_spill_to_disk();
+    test_batch_dequeue();
+    test_worker_pool();
+    test_relaxed_queue();
+    test_compact_storage();
+    test_node_arena();
+    test_fair_tenants();
+    test_coalescing();
+    test_peek_and_iteration();
+    test_cancellable_dequeue();
+    test_pipeline();
+#ifdef QUEUE_TRACE
+    test_tracing();
+#endif
+
+    printf("All mode tests passed!\n");
+
+    return 0;
+}